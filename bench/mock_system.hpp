@@ -0,0 +1,292 @@
+#pragma once
+
+#include "logger.hpp"
+#include "system.hpp"
+#include "vhub_ports.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/container/flat_map.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Stand-ins for system interaction used by state machine in benchmark build
+// (VM_SYSTEM_SEAMS). Nothing is spawned and neither configfs nor udev is
+// touched, so only daemon's own overhead is measured. Spawned process makes
+// device appear after configured delay and stopping it makes it disappear.
+namespace seams
+{
+
+struct Counters
+{
+    // Processes production build would fork
+    uint64_t forks = 0;
+    uint64_t stops = 0;
+    uint64_t gadgetConfigurations = 0;
+    uint64_t udevEvents = 0;
+};
+
+inline Counters counters;
+
+// Simulated latencies of the mocked system
+struct Delays
+{
+    // From spawn until device reports it is connected
+    std::chrono::microseconds deviceReady{0};
+    // From stop until process exits
+    std::chrono::microseconds processExit{0};
+};
+
+inline Delays delays;
+
+class DeviceMonitor
+{
+  public:
+    using Handler = std::function<void(StateChange)>;
+
+    DeviceMonitor(boost::asio::io_context&)
+    {
+        active = this;
+    }
+
+    DeviceMonitor(const DeviceMonitor&) = delete;
+    DeviceMonitor& operator=(const DeviceMonitor&) = delete;
+
+    ~DeviceMonitor()
+    {
+        active = nullptr;
+    }
+
+    void onUdcChange(
+        std::function<void(const std::string&, const std::string&)>)
+    {}
+
+    void run()
+    {}
+
+    void addDevice(const NBDDevice& device, Handler handler)
+    {
+        devices[device] = {StateChange::unknown, std::move(handler)};
+    }
+
+    void removeDevice(const NBDDevice& device)
+    {
+        devices.erase(device);
+    }
+
+    StateChange getState(const NBDDevice& device)
+    {
+        auto monitoredDevice = devices.find(device);
+        if (monitoredDevice != devices.cend())
+        {
+            return monitoredDevice->second.state;
+        }
+        return StateChange::notMonitored;
+    }
+
+    // Delivers udev event the same way as real monitor does, only for
+    // watched devices and only on actual change
+    static void notify(const NBDDevice& device, StateChange change)
+    {
+        if (active == nullptr)
+        {
+            return;
+        }
+        auto monitoredDevice = active->devices.find(device);
+        if (monitoredDevice == active->devices.end() ||
+            monitoredDevice->second.state == change)
+        {
+            return;
+        }
+        monitoredDevice->second.state = change;
+        counters.udevEvents++;
+        Handler handler = monitoredDevice->second.handler;
+        handler(change);
+    }
+
+  private:
+    struct Watch
+    {
+        StateChange state;
+        Handler handler;
+    };
+
+    static inline DeviceMonitor* active = nullptr;
+
+    boost::container::flat_map<NBDDevice, Watch> devices;
+};
+
+class Process : public std::enable_shared_from_this<Process>
+{
+  public:
+    Process(boost::asio::io_context& ioc, const std::string& name,
+            const std::string& app, const NBDDevice& dev) :
+        ioc(ioc),
+        name(name), app(app), dev(dev)
+    {}
+
+    template <typename ExitCb>
+    bool spawn(const std::vector<std::string>& args, ExitCb&& onExit)
+    {
+        LogMsg(Logger::Debug, "[Process]: Mock spawn of ", app, " (", args,
+               ")");
+        // nbdkit forks nbd-client on its own (--run)
+        counters.forks +=
+            std::find(args.begin(), args.end(), "--run") != args.end() ? 2 : 1;
+        // Like real child, process lives until it exits
+        running = shared_from_this();
+
+        // Exit callbacks may be move-only (holding secret file)
+        auto callback =
+            std::make_shared<std::decay_t<ExitCb>>(std::move(onExit));
+        exitCallback = [callback](int exitCode, bool isReady) {
+            (*callback)(exitCode, isReady);
+        };
+
+        after(delays.deviceReady, [this]() {
+            if (!exited)
+            {
+                DeviceMonitor::notify(dev, StateChange::inserted);
+            }
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        counters.stops++;
+        after(delays.processExit, [this]() {
+            if (exited)
+            {
+                return;
+            }
+            exited = true;
+            // Udev notification usually comes after process is gone
+            exitCallback(0, false);
+            DeviceMonitor::notify(dev, StateChange::removed);
+            running.reset();
+        });
+    }
+
+    // Nothing survives between benchmark runs
+    template <typename ExitCb>
+    bool adopt(pid_t, ExitCb&&)
+    {
+        return false;
+    }
+
+    void release()
+    {}
+
+    pid_t pid()
+    {
+        return 0;
+    }
+
+    std::string application()
+    {
+        return app;
+    }
+
+  private:
+    template <typename Function>
+    void after(std::chrono::microseconds delay, Function&& function)
+    {
+        auto timer = std::make_shared<boost::asio::steady_timer>(ioc, delay);
+        timer->async_wait([self = shared_from_this(), timer,
+                           function = std::forward<Function>(function)](
+                              const boost::system::error_code&) mutable {
+            function();
+        });
+    }
+
+    boost::asio::io_context& ioc;
+    std::string name;
+    std::string app;
+    NBDDevice dev;
+    std::function<void(int, bool)> exitCallback;
+    bool exited = false;
+    std::shared_ptr<Process> running;
+};
+
+struct UsbGadget
+{
+    static int32_t configure(VhubPortAllocator&, const std::string&,
+                             const NBDDevice&, StateChange, const bool = false,
+                             const bool = false)
+    {
+        counters.gadgetConfigurations++;
+        return 0;
+    }
+
+    static bool provision(VhubPortAllocator&, const std::string&)
+    {
+        counters.gadgetConfigurations++;
+        return true;
+    }
+
+    static int32_t attach(VhubPortAllocator&, const std::string&,
+                          const fs::path&, const bool = false,
+                          const bool = false)
+    {
+        counters.gadgetConfigurations++;
+        return 0;
+    }
+
+    static int32_t detach(VhubPortAllocator&, const std::string&)
+    {
+        counters.gadgetConfigurations++;
+        return 0;
+    }
+
+    static bool provisionShared(VhubPortAllocator&, const std::string&,
+                                const std::vector<bool>&)
+    {
+        counters.gadgetConfigurations++;
+        return true;
+    }
+
+    static int32_t attachLun(VhubPortAllocator&, const std::string&, unsigned,
+                             const fs::path&, const bool = false,
+                             const bool = false)
+    {
+        counters.gadgetConfigurations++;
+        return 0;
+    }
+
+    static int32_t detachLun(VhubPortAllocator&, const std::string&, unsigned)
+    {
+        counters.gadgetConfigurations++;
+        return 0;
+    }
+
+    static bool isAttached(const std::string&, unsigned, const fs::path&)
+    {
+        return false;
+    }
+};
+
+struct UdevGadget
+{
+    static void forceUdevChange(const NBDDevice&)
+    {}
+};
+
+struct Medium
+{
+    static constexpr const int cdromBlockSize = 2048;
+
+    static bool isIso(const fs::path&)
+    {
+        return false;
+    }
+};
+
+} // namespace seams
@@ -0,0 +1,234 @@
+// Drives mount point state machine through repeated Mount/Unmount cycles with
+// system interaction mocked out (see mock_system.hpp) and reports latency of
+// each phase, number of forks production build would do and peak RSS.
+//
+//   virtual-media-bench [--cycles N] [--mode proxy|legacy] [--builtin]
+//                       [--device-delay-us N] [--exit-delay-us N]
+
+#include "mock_system.hpp"
+
+#include "configuration.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "state_machine.hpp"
+#include "trace.hpp"
+
+#include <sys/resource.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <sdbusplus/asio/connection.hpp>
+#include <sdbusplus/asio/object_server.hpp>
+#include <string>
+#include <string_view>
+
+namespace
+{
+
+struct Options
+{
+    unsigned cycles = 1000;
+    Configuration::Mode mode = Configuration::Mode::proxy;
+    bool builtinNbdServer = false;
+};
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string_view arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--builtin")
+        {
+            options.builtinNbdServer = true;
+        }
+        else if (arg == "--cycles" && hasValue)
+        {
+            options.cycles = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--mode" && hasValue)
+        {
+            const std::string_view mode = argv[++i];
+            if (mode != "proxy" && mode != "legacy")
+            {
+                return false;
+            }
+            options.mode = mode == "proxy" ? Configuration::Mode::proxy
+                                           : Configuration::Mode::legacy;
+        }
+        else if (arg == "--device-delay-us" && hasValue)
+        {
+            seams::delays.deviceReady =
+                std::chrono::microseconds(std::stoul(argv[++i]));
+        }
+        else if (arg == "--exit-delay-us" && hasValue)
+        {
+            seams::delays.processExit =
+                std::chrono::microseconds(std::stoul(argv[++i]));
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+nlohmann::json toJson(const LatencyHistogram& histogram)
+{
+    return {{"count", histogram.count},
+            {"avgUs", histogram.averageUs()},
+            {"p50Us", histogram.percentile(50)},
+            {"p90Us", histogram.percentile(90)},
+            {"p99Us", histogram.percentile(99)},
+            {"maxUs", histogram.percentile(100)}};
+}
+
+// Time spent in each state during last cycle, taken from the trace ring
+void collectStateTimes(std::map<std::string, LatencyHistogram>& phases)
+{
+    auto& ring = TraceRing::instance();
+    const auto trace = nlohmann::json::parse(ring.dumpChromeTrace());
+    ring.clear();
+    for (const auto& event : trace["traceEvents"])
+    {
+        if (event["ph"] != "X")
+        {
+            continue;
+        }
+        const std::string name = event["name"];
+        // Machine rests in ReadyState between cycles
+        if (name == "ReadyState")
+        {
+            continue;
+        }
+        phases[name].record(
+            std::chrono::microseconds(event["dur"].get<int64_t>()));
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    try
+    {
+        if (!parseOptions(argc, argv, options))
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--cycles N] [--mode proxy|legacy] [--builtin]"
+                         " [--device-delay-us N] [--exit-delay-us N]\n";
+            return EXIT_FAILURE;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    // Logging would dominate measured times
+    Logger::setLevel(Logger::Critical::value);
+
+    boost::asio::io_context ioc;
+    sd_bus* b = nullptr;
+    // Objects are exported on own unique name, running daemon is not affected
+    sd_bus_default(&b);
+    auto bus = std::make_shared<sdbusplus::asio::connection>(ioc, b);
+    auto objServer = std::make_shared<sdbusplus::asio::object_server>(bus);
+
+    WorkerPool workers;
+    SmbShareManager smbShares(ioc, workers);
+    seams::DeviceMonitor devMonitor(ioc);
+    VhubPortAllocator ports;
+    NBDDeviceAllocator nbdDevices;
+
+    Configuration::MountPoint config;
+    config.nbdDevice = NBDDevice("nbd0");
+    config.unixSocket = "/tmp/virtual-media-bench.sock";
+    config.endPointId = "bench";
+    config.mode = options.mode;
+    config.builtinNbdServer = options.builtinNbdServer;
+
+    auto machine = std::make_shared<MountPointStateMachine>(
+        ioc, devMonitor, ports, nbdDevices, workers, smbShares, "Slot_0",
+        config, bus);
+    devMonitor.run();
+    machine->emitRegisterDBusEvent(objServer);
+    TraceRing::instance().clear();
+
+    std::map<std::string, LatencyHistogram> phases;
+    uint64_t failures = 0;
+    static constexpr const std::chrono::seconds timeout{10};
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield) {
+        using Machine = MountPointStateMachine;
+        for (unsigned cycle = 0; cycle < options.cycles; cycle++)
+        {
+            if (options.mode == Configuration::Mode::legacy)
+            {
+                machine->target = {"https://bench.invalid/image.iso", false};
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            machine->emitMountEvent();
+            if (!machine->waitForState<Machine::ActiveState,
+                                       Machine::ReadyState>(yield, timeout) ||
+                !std::holds_alternative<Machine::ActiveState>(machine->state))
+            {
+                failures++;
+                machine->waitForState<Machine::ReadyState>(yield, timeout);
+                TraceRing::instance().clear();
+                continue;
+            }
+            phases["Mount"].record(std::chrono::steady_clock::now() - start);
+
+            start = std::chrono::steady_clock::now();
+            machine->emitUnmountEvent();
+            if (!machine->waitForState<Machine::ReadyState>(yield, timeout))
+            {
+                failures++;
+                break;
+            }
+            phases["Unmount"].record(std::chrono::steady_clock::now() - start);
+
+            collectStateTimes(phases);
+        }
+        ioc.stop();
+    });
+
+    const auto started = std::chrono::steady_clock::now();
+    ioc.run();
+    const auto elapsed = std::chrono::steady_clock::now() - started;
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+
+    nlohmann::json report = {
+        {"cycles", options.cycles},
+        {"failures", failures},
+        {"elapsedMs", std::chrono::duration_cast<std::chrono::milliseconds>(
+                          elapsed)
+                          .count()},
+        {"forks", seams::counters.forks},
+        {"forksPerCycle",
+         options.cycles ? double(seams::counters.forks) / options.cycles : 0.0},
+        {"gadgetConfigurations", seams::counters.gadgetConfigurations},
+        {"udevEvents", seams::counters.udevEvents},
+        {"peakRssKiB", usage.ru_maxrss},
+        {"phases", nlohmann::json::object()}};
+    for (const auto& [name, histogram] : phases)
+    {
+        report["phases"][name] = toJson(histogram);
+    }
+    std::cout << report.dump(2) << std::endl;
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
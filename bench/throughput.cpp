@@ -0,0 +1,420 @@
+// Block throughput of images served by running daemon. Each given URL is
+// mounted through Legacy mode (so CIFS and HTTPS backends can be compared),
+// sequential and random read workloads are run against the resulting NBD
+// device and MB/s and IOPS are reported as JSON.
+//
+//   virtual-media-throughput --generate FILE [--size-mib N]
+//   virtual-media-throughput [--slot NAME] --url URL [--url URL ...]
+//                            [--bs KIB ...] [--qd N ...] [--runtime SECONDS]
+//                            [--workload seq|rand|both]
+//   virtual-media-throughput --device PATH [workload options]
+//
+// Synthetic image made by --generate has to be placed on CIFS share or HTTPS
+// server by the user, URLs have to point to it.
+
+#include "metrics.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <random>
+#include <sdbusplus/asio/connection.hpp>
+#include <sdbusplus/message.hpp>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <variant>
+#include <vector>
+
+namespace
+{
+
+constexpr const char* service = "xyz.openbmc_project.VirtualMedia";
+constexpr const char* legacyPath = "/xyz/openbmc_project/VirtualMedia/Legacy/";
+
+struct Options
+{
+    std::string slot = "Slot_0";
+    std::vector<std::string> urls;
+    std::optional<std::string> device;
+    std::optional<std::string> generate;
+    uint64_t sizeMiB = 1024;
+    std::vector<uint32_t> blockSizesKiB;
+    std::vector<unsigned> queueDepths;
+    std::chrono::seconds runtime{10};
+    bool sequential = true;
+    bool random = true;
+};
+
+struct Workload
+{
+    bool random;
+    uint32_t blockSize;
+    unsigned queueDepth;
+};
+
+struct Result
+{
+    uint64_t bytes = 0;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    LatencyHistogram latency;
+    std::chrono::steady_clock::duration elapsed{};
+};
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string_view arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--slot")
+        {
+            options.slot = value;
+        }
+        else if (arg == "--url")
+        {
+            options.urls.push_back(value);
+        }
+        else if (arg == "--device")
+        {
+            options.device = value;
+        }
+        else if (arg == "--generate")
+        {
+            options.generate = value;
+        }
+        else if (arg == "--size-mib")
+        {
+            options.sizeMiB = std::stoull(value);
+        }
+        else if (arg == "--bs")
+        {
+            options.blockSizesKiB.push_back(
+                static_cast<uint32_t>(std::stoul(value)));
+        }
+        else if (arg == "--qd")
+        {
+            options.queueDepths.push_back(
+                static_cast<unsigned>(std::stoul(value)));
+        }
+        else if (arg == "--runtime")
+        {
+            options.runtime = std::chrono::seconds(std::stoul(value));
+        }
+        else if (arg == "--workload")
+        {
+            if (value != "seq" && value != "rand" && value != "both")
+            {
+                return false;
+            }
+            options.sequential = value != "rand";
+            options.random = value != "seq";
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (options.blockSizesKiB.empty())
+    {
+        options.blockSizesKiB = {4, 128, 1024};
+    }
+    if (options.queueDepths.empty())
+    {
+        options.queueDepths = {1, 4};
+    }
+    for (auto blockSize : options.blockSizesKiB)
+    {
+        if (blockSize == 0)
+        {
+            return false;
+        }
+    }
+    for (auto queueDepth : options.queueDepths)
+    {
+        if (queueDepth == 0)
+        {
+            return false;
+        }
+    }
+    return options.generate || options.device || !options.urls.empty();
+}
+
+// Pseudo random content, so that neither compression nor zero detection
+// anywhere on the way flatters the numbers
+bool generateImage(const std::string& path, uint64_t sizeMiB)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    std::mt19937_64 generator(sizeMiB);
+    std::vector<uint64_t> chunk(1024 * 1024 / sizeof(uint64_t));
+    for (uint64_t i = 0; i < sizeMiB && file; i++)
+    {
+        for (auto& word : chunk)
+        {
+            word = generator();
+        }
+        file.write(reinterpret_cast<const char*>(chunk.data()),
+                   static_cast<std::streamsize>(chunk.size() *
+                                                sizeof(uint64_t)));
+    }
+    return static_cast<bool>(file);
+}
+
+// Every queue slot is a thread issuing one read at a time. Sequential
+// workload shares single offset between them, like single stream with
+// requests in flight.
+std::optional<Result> runWorkload(const std::string& path,
+                                  const Workload& workload,
+                                  std::chrono::seconds runtime)
+{
+    // Page cache would hide the device
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL)
+    {
+        fd = ::open(path.c_str(), O_RDONLY);
+    }
+    if (fd < 0)
+    {
+        std::cerr << "Unable to open " << path << ": " << strerror(errno)
+                  << "\n";
+        return {};
+    }
+    const off_t size = ::lseek(fd, 0, SEEK_END);
+    const uint64_t blocks =
+        size > 0 ? static_cast<uint64_t>(size) / workload.blockSize : 0;
+    if (blocks == 0)
+    {
+        std::cerr << path << " is smaller than block size\n";
+        ::close(fd);
+        return {};
+    }
+
+    std::atomic<uint64_t> nextBlock{0};
+    std::vector<Result> partial(workload.queueDepth);
+    std::vector<std::thread> threads;
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + runtime;
+
+    for (unsigned slot = 0; slot < workload.queueDepth; slot++)
+    {
+        threads.emplace_back([&, slot]() {
+            Result& result = partial[slot];
+            std::unique_ptr<char, decltype(&std::free)> buffer(
+                static_cast<char*>(std::aligned_alloc(4096, workload.blockSize)),
+                &std::free);
+            std::mt19937_64 generator(slot);
+
+            while (std::chrono::steady_clock::now() < deadline)
+            {
+                const uint64_t block =
+                    workload.random
+                        ? generator() % blocks
+                        : nextBlock.fetch_add(1, std::memory_order_relaxed) %
+                              blocks;
+                const auto issued = std::chrono::steady_clock::now();
+                const ssize_t ret =
+                    ::pread(fd, buffer.get(), workload.blockSize,
+                            static_cast<off_t>(block * workload.blockSize));
+                result.latency.record(std::chrono::steady_clock::now() -
+                                      issued);
+                if (ret <= 0)
+                {
+                    result.errors++;
+                    continue;
+                }
+                result.requests++;
+                result.bytes += static_cast<uint64_t>(ret);
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    ::close(fd);
+
+    Result result;
+    result.elapsed = std::chrono::steady_clock::now() - start;
+    for (const auto& part : partial)
+    {
+        result.bytes += part.bytes;
+        result.requests += part.requests;
+        result.errors += part.errors;
+        for (size_t bucket = 0; bucket < LatencyHistogram::bucketCount;
+             bucket++)
+        {
+            result.latency.buckets[bucket] += part.latency.buckets[bucket];
+        }
+        result.latency.count += part.latency.count;
+        result.latency.totalUs += part.latency.totalUs;
+    }
+    return result;
+}
+
+nlohmann::json runWorkloads(const std::string& path, const Options& options)
+{
+    nlohmann::json results = nlohmann::json::array();
+    for (const bool random : {false, true})
+    {
+        if ((random && !options.random) || (!random && !options.sequential))
+        {
+            continue;
+        }
+        for (auto blockSizeKiB : options.blockSizesKiB)
+        {
+            for (auto queueDepth : options.queueDepths)
+            {
+                const Workload workload{random, blockSizeKiB * 1024,
+                                        queueDepth};
+                auto result = runWorkload(path, workload, options.runtime);
+                if (!result)
+                {
+                    return results;
+                }
+                const double seconds =
+                    std::chrono::duration<double>(result->elapsed).count();
+                results.push_back(
+                    {{"workload", random ? "randread" : "seqread"},
+                     {"blockSizeKiB", blockSizeKiB},
+                     {"queueDepth", queueDepth},
+                     {"MBps", double(result->bytes) / (1024 * 1024) / seconds},
+                     {"iops", double(result->requests) / seconds},
+                     {"errors", result->errors},
+                     {"latencyAvgUs", result->latency.averageUs()},
+                     {"latencyP50Us", result->latency.percentile(50)},
+                     {"latencyP99Us", result->latency.percentile(99)}});
+            }
+        }
+    }
+    return results;
+}
+
+// Mounts image through the daemon and returns NBD device it ended up on
+std::optional<std::string>
+    mount(sdbusplus::asio::connection& bus, const std::string& path,
+          const std::string& url, boost::asio::yield_context yield)
+{
+    using optional_fd = std::variant<int, sdbusplus::message::unix_fd>;
+    boost::system::error_code ec;
+    const bool mounted = bus.yield_method_call<bool>(
+        yield, ec, service, path, "xyz.openbmc_project.VirtualMedia.Legacy",
+        "Mount", url, false, optional_fd(-1));
+    if (ec || !mounted)
+    {
+        std::cerr << "Mount of " << url << " failed: " << ec.message()
+                  << "\n";
+        return {};
+    }
+
+    const auto device = bus.yield_method_call<std::variant<std::string>>(
+        yield, ec, service, path, "org.freedesktop.DBus.Properties", "Get",
+        "xyz.openbmc_project.VirtualMedia.MountPoint", "Device");
+    if (ec || std::get<std::string>(device).empty())
+    {
+        std::cerr << "Unable to get device of " << path << "\n";
+        return {};
+    }
+    return "/dev/" + std::get<std::string>(device);
+}
+
+void unmount(sdbusplus::asio::connection& bus, const std::string& path,
+             boost::asio::yield_context yield)
+{
+    boost::system::error_code ec;
+    bus.yield_method_call<bool>(yield, ec, service, path,
+                                "xyz.openbmc_project.VirtualMedia.Legacy",
+                                "Unmount");
+    if (ec)
+    {
+        std::cerr << "Unmount of " << path << " failed: " << ec.message()
+                  << "\n";
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    try
+    {
+        if (!parseOptions(argc, argv, options))
+        {
+            std::cerr
+                << "Usage: " << argv[0]
+                << " --generate FILE [--size-mib N]\n       " << argv[0]
+                << " [--slot NAME] (--url URL ... | --device PATH)"
+                   " [--bs KIB ...] [--qd N ...] [--runtime SECONDS]"
+                   " [--workload seq|rand|both]\n";
+            return EXIT_FAILURE;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    if (options.generate)
+    {
+        return generateImage(*options.generate, options.sizeMiB)
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+    }
+
+    nlohmann::json report = {{"runtimeS", options.runtime.count()},
+                             {"results", nlohmann::json::array()}};
+    if (options.device)
+    {
+        report["results"].push_back(
+            {{"device", *options.device},
+             {"workloads", runWorkloads(*options.device, options)}});
+        std::cout << report.dump(2) << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    boost::asio::io_context ioc;
+    auto bus = std::make_shared<sdbusplus::asio::connection>(ioc);
+    bool success = true;
+
+    boost::asio::spawn(ioc, [&](boost::asio::yield_context yield) {
+        const std::string path = legacyPath + options.slot;
+        for (const auto& url : options.urls)
+        {
+            auto device = mount(*bus, path, url, yield);
+            if (!device)
+            {
+                success = false;
+                continue;
+            }
+            // Blocks event loop on purpose, nothing else runs meanwhile
+            report["results"].push_back(
+                {{"url", url},
+                 {"device", *device},
+                 {"workloads", runWorkloads(*device, options)}});
+            unmount(*bus, path, yield);
+        }
+        ioc.stop();
+    });
+    ioc.run();
+
+    std::cout << report.dump(2) << std::endl;
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
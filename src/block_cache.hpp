@@ -0,0 +1,328 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd_server.hpp"
+
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace nbd
+{
+
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// Read cache placed in front of slow backend (eg. HTTPS). Image is split into
+// large, aligned chunks kept in bounded LRU, so small guest reads do not turn
+// into separate remote requests. Sequential access is detected and following
+// chunks are fetched ahead of the guest in the background.
+class CachedBackend :
+    public Backend,
+    public std::enable_shared_from_this<CachedBackend>
+{
+  public:
+    static constexpr const uint64_t chunkSize = 128 * 1024;
+
+    CachedBackend(boost::asio::io_context& ioc, std::shared_ptr<Backend> inner,
+                  uint64_t cacheSize, uint64_t readAhead, CacheStats& stats) :
+        ioc(ioc),
+        inner(std::move(inner)),
+        readAheadChunks((readAhead + chunkSize - 1) / chunkSize), stats(stats)
+    {
+        // Whole read-ahead window has to fit, along with chunks being read
+        capacity = std::max<uint64_t>(cacheSize / chunkSize,
+                                      2 * readAheadChunks + 2);
+        LogMsg(Logger::Debug, "[CachedBackend]: ", capacity,
+               " chunks of cache, read-ahead ", readAheadChunks, " chunks");
+    }
+
+    bool initialize(boost::asio::yield_context yield) override
+    {
+        return inner->initialize(yield);
+    }
+
+    void close() override
+    {
+        closed = true;
+        lru.clear();
+        entries.clear();
+        inner->close();
+    }
+
+    uint64_t size() const override
+    {
+        return inner->size();
+    }
+
+    bool readOnly() const override
+    {
+        return inner->readOnly();
+    }
+
+    unsigned concurrency() const override
+    {
+        return inner->concurrency();
+    }
+
+    int read(uint64_t offset, char* data, size_t length,
+             boost::asio::yield_context yield) override
+    {
+        if (length == 0)
+        {
+            return 0;
+        }
+
+        const uint64_t first = offset / chunkSize;
+        const uint64_t last = (offset + length - 1) / chunkSize;
+
+        // Requests not fitting into cache are passed through
+        if (last - first + 1 > capacity / 2)
+        {
+            return inner->read(offset, data, length, yield);
+        }
+
+        const bool sequential = (offset == nextSequentialOffset);
+        nextSequentialOffset = offset + length;
+
+        uint64_t index = first;
+        while (index <= last)
+        {
+            if (closed)
+            {
+                return ESHUTDOWN;
+            }
+
+            if (const std::vector<char>* chunk = lookup(index))
+            {
+                stats.hits++;
+                copyOut(*chunk, index, offset, data, length);
+                index++;
+                continue;
+            }
+
+            // Someone else is already fetching, wait for it and retry
+            const auto pendingIt = pending.find(index);
+            if (pendingIt != pending.end())
+            {
+                auto done = pendingIt->second;
+                boost::system::error_code ignored_ec;
+                done->async_wait(yield[ignored_ec]);
+                continue;
+            }
+
+            // Fetch all missing chunks of this request in single backend
+            // request, sequential access extends it by read-ahead window
+            const uint64_t want =
+                std::min(last + 1 + (sequential ? readAheadChunks : 0),
+                         chunkCount());
+            uint64_t end = index + 1;
+            while (end < want && !entries.count(end) && !pending.count(end))
+            {
+                end++;
+            }
+            std::vector<char> fetched;
+            int error = fetch(index, end, yield, &fetched);
+            if (error)
+            {
+                return error;
+            }
+            // Requested chunks are served from what was fetched, read-ahead
+            // beyond the request is not a miss
+            const uint64_t served = std::min(end, last + 1);
+            stats.misses += served - index;
+            copyOut(fetched, index, offset, data, length);
+            index = served;
+        }
+
+        if (sequential)
+        {
+            readAhead(last + 1);
+        }
+        return 0;
+    }
+
+    int write(uint64_t offset, const char* data, size_t length,
+              boost::asio::yield_context yield) override
+    {
+        if (length > 0)
+        {
+            const uint64_t last = (offset + length - 1) / chunkSize;
+            for (uint64_t index = offset / chunkSize; index <= last; index++)
+            {
+                invalidate(index);
+            }
+        }
+        return inner->write(offset, data, length, yield);
+    }
+
+    int flush(boost::asio::yield_context yield) override
+    {
+        return inner->flush(yield);
+    }
+
+  private:
+    struct Chunk
+    {
+        uint64_t index;
+        std::vector<char> data;
+    };
+
+    uint64_t chunkCount() const
+    {
+        return (inner->size() + chunkSize - 1) / chunkSize;
+    }
+
+    const std::vector<char>* lookup(uint64_t index)
+    {
+        const auto it = entries.find(index);
+        if (it == entries.end())
+        {
+            return nullptr;
+        }
+        // Mark as most recently used
+        lru.splice(lru.begin(), lru, it->second);
+        return &it->second->data;
+    }
+
+    void insert(uint64_t index, std::vector<char>&& data)
+    {
+        invalidate(index);
+        lru.push_front(Chunk{index, std::move(data)});
+        entries[index] = lru.begin();
+        while (lru.size() > capacity)
+        {
+            entries.erase(lru.back().index);
+            lru.pop_back();
+        }
+    }
+
+    void invalidate(uint64_t index)
+    {
+        const auto it = entries.find(index);
+        if (it != entries.end())
+        {
+            lru.erase(it->second);
+            entries.erase(it);
+        }
+    }
+
+    static void copyOut(const std::vector<char>& chunk, uint64_t index,
+                        uint64_t offset, char* data, size_t length)
+    {
+        const uint64_t chunkBegin = index * chunkSize;
+        const uint64_t begin = std::max(offset, chunkBegin);
+        const uint64_t end =
+            std::min<uint64_t>(offset + length, chunkBegin + chunk.size());
+        std::copy(chunk.begin() + (begin - chunkBegin),
+                  chunk.begin() + (end - chunkBegin), data + (begin - offset));
+    }
+
+    // Reads chunks [begin, end) from backend with single request, whole
+    // range is also handed over in fetched when requested
+    int fetch(uint64_t begin, uint64_t end, boost::asio::yield_context yield,
+              std::vector<char>* fetched = nullptr)
+    {
+        auto done = std::make_shared<boost::asio::steady_timer>(
+            ioc, boost::asio::steady_timer::time_point::max());
+        for (uint64_t index = begin; index < end; index++)
+        {
+            pending[index] = done;
+        }
+
+        const uint64_t offset = begin * chunkSize;
+        const uint64_t length =
+            std::min(end * chunkSize, inner->size()) - offset;
+        std::vector<char> buffer(length);
+        int error = inner->read(offset, buffer.data(), length, yield);
+
+        for (uint64_t index = begin; index < end; index++)
+        {
+            pending.erase(index);
+        }
+        // Wake up everyone waiting for these chunks
+        done->cancel();
+
+        if (error)
+        {
+            return error;
+        }
+        if (closed)
+        {
+            return ESHUTDOWN;
+        }
+
+        for (uint64_t index = begin; index < end; index++)
+        {
+            const auto chunkBegin = buffer.begin() + (index - begin) * chunkSize;
+            const auto chunkEnd = (index + 1 == end) ? buffer.end()
+                                                     : chunkBegin + chunkSize;
+            insert(index, std::vector<char>(chunkBegin, chunkEnd));
+        }
+        if (fetched)
+        {
+            *fetched = std::move(buffer);
+        }
+        return 0;
+    }
+
+    // Keeps read-ahead window following sequential reader filled. Refill is
+    // started only when at least half of the window is missing, so backend
+    // gets few large requests instead of many single chunk ones.
+    void readAhead(uint64_t from)
+    {
+        if (readAheadChunks == 0 || closed)
+        {
+            return;
+        }
+
+        const uint64_t windowEnd = std::min(from + readAheadChunks, chunkCount());
+        uint64_t begin = from;
+        while (begin < windowEnd && (entries.count(begin) || pending.count(begin)))
+        {
+            begin++;
+        }
+        if (windowEnd - begin < std::max<uint64_t>(readAheadChunks / 2, 1))
+        {
+            return;
+        }
+        uint64_t end = begin + 1;
+        while (end < windowEnd && !entries.count(end) && !pending.count(end))
+        {
+            end++;
+        }
+
+        boost::asio::spawn(ioc, [this, self = shared_from_this(), begin,
+                                 end](boost::asio::yield_context yield) {
+            int error = fetch(begin, end, yield);
+            if (error && !closed)
+            {
+                LogMsg(Logger::Debug, "[CachedBackend]: Read-ahead failed: ",
+                       error);
+            }
+        });
+    }
+
+    boost::asio::io_context& ioc;
+    std::shared_ptr<Backend> inner;
+    uint64_t capacity;
+    uint64_t readAheadChunks;
+    CacheStats& stats;
+    uint64_t nextSequentialOffset = 0;
+    bool closed = false;
+
+    std::list<Chunk> lru;
+    std::unordered_map<uint64_t, std::list<Chunk>::iterator> entries;
+    std::unordered_map<uint64_t, std::shared_ptr<boost::asio::steady_timer>>
+        pending;
+};
+
+} // namespace nbd
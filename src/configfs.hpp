@@ -0,0 +1,216 @@
+#pragma once
+
+#include "logger.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Direct syscall based access to configfs (and other sysfs-like attribute
+// files), without spawning shell or going through iostreams
+namespace configfs
+{
+
+struct Error
+{
+    std::error_code code;
+    const char* operation;
+    fs::path path;
+};
+
+static std::ostream& operator<<(std::ostream& os, const Error& error)
+{
+    return os << error.operation << " " << error.path << ": "
+              << error.code.message();
+}
+
+static std::optional<Error> makeError(const char* operation,
+                                      const fs::path& path)
+{
+    return Error{std::error_code(errno, std::generic_category()), operation,
+                 path};
+}
+
+// Writes attribute with single write() call, as configfs expects
+static std::optional<Error> write(const fs::path& path,
+                                  const std::string& content)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return makeError("open", path);
+    }
+    const std::string line = content + "\n";
+    ssize_t ret = ::write(fd, line.data(), line.size());
+    std::optional<Error> error;
+    if (ret < 0)
+    {
+        error = makeError("write", path);
+    }
+    ::close(fd);
+    if (!error)
+    {
+        LogMsg(Logger::Debug, "echo ", content, " > ", path);
+    }
+    return error;
+}
+
+// Reads attribute value without trailing newline, empty on failure
+static std::string read(const fs::path& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return {};
+    }
+    char buffer[256];
+    ssize_t ret = ::read(fd, buffer, sizeof(buffer));
+    ::close(fd);
+    if (ret <= 0)
+    {
+        return {};
+    }
+    std::string content(buffer, static_cast<size_t>(ret));
+    while (!content.empty() && content.back() == '\n')
+    {
+        content.pop_back();
+    }
+    return content;
+}
+
+static std::optional<Error> rmdir(const fs::path& path)
+{
+    if (::rmdir(path.c_str()) < 0 && errno != ENOENT)
+    {
+        return makeError("rmdir", path);
+    }
+    return {};
+}
+
+static std::optional<Error> unlink(const fs::path& path)
+{
+    if (::unlink(path.c_str()) < 0 && errno != ENOENT)
+    {
+        return makeError("unlink", path);
+    }
+    return {};
+}
+
+// Builds configfs tree step by step and records every created entry. Unless
+// committed, all of them are removed in reverse order when transaction is
+// destroyed, so failure in the middle does not leave partial tree behind.
+class Transaction
+{
+  public:
+    Transaction() = default;
+    Transaction(const Transaction&) = delete;
+    Transaction& operator=(const Transaction&) = delete;
+
+    ~Transaction()
+    {
+        if (!committed)
+        {
+            rollback();
+        }
+    }
+
+    // Creates directory. Already existing one is accepted but not recorded,
+    // as it is not owned by this transaction.
+    bool mkdir(const fs::path& path)
+    {
+        if (error)
+        {
+            return false;
+        }
+        if (::mkdir(path.c_str(), 0755) < 0)
+        {
+            if (errno == EEXIST)
+            {
+                return true;
+            }
+            error = makeError("mkdir", path);
+            return false;
+        }
+        created.push_back({path, Entry::Type::directory});
+        return true;
+    }
+
+    bool symlink(const fs::path& target, const fs::path& link)
+    {
+        if (error)
+        {
+            return false;
+        }
+        if (::symlink(target.c_str(), link.c_str()) < 0)
+        {
+            error = makeError("symlink", link);
+            return false;
+        }
+        created.push_back({link, Entry::Type::link});
+        return true;
+    }
+
+    bool write(const fs::path& path, const std::string& content)
+    {
+        if (error)
+        {
+            return false;
+        }
+        error = configfs::write(path, content);
+        return !error;
+    }
+
+    void commit()
+    {
+        committed = true;
+        created.clear();
+    }
+
+    void rollback()
+    {
+        for (auto it = created.rbegin(); it != created.rend(); ++it)
+        {
+            auto ret = (it->type == Entry::Type::link) ? unlink(it->path)
+                                                       : rmdir(it->path);
+            if (ret)
+            {
+                LogMsg(Logger::Error, "[configfs]: Rollback failed: ", *ret);
+            }
+        }
+        created.clear();
+    }
+
+    // First error encountered, all operations following it are skipped
+    const std::optional<Error>& lastError() const
+    {
+        return error;
+    }
+
+  private:
+    struct Entry
+    {
+        enum class Type
+        {
+            directory,
+            link
+        };
+
+        fs::path path;
+        Type type;
+    };
+
+    std::vector<Entry> created;
+    std::optional<Error> error;
+    bool committed = false;
+};
+
+} // namespace configfs
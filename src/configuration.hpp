@@ -1,11 +1,17 @@
 #pragma once
 
 #include "logger.hpp"
+#include "smb.hpp"
 #include "system.hpp"
 
 #include <algorithm>
 #include <boost/container/flat_map.hpp>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <string>
@@ -30,18 +36,73 @@ class Configuration
     struct MountPoint
     {
         NBDDevice nbdDevice;
+        // Device is allocated on activation ("NBDDevice": "auto" or not set)
+        bool dynamicNbdDevice = false;
         std::string unixSocket;
         std::string endPointId;
         std::optional<int> timeout;
         std::optional<int> blocksize;
         Mode mode;
+        // Serve Legacy mode images from within the daemon instead of nbdkit
+        bool builtinNbdServer = false;
+        // Read cache for HTTPS images, disabled when both are zero
+        uint32_t cacheSizeMiB = 0;
+        uint32_t readAheadKiB = 0;
+        // Persistent HTTPS connections, and so range requests in flight, per
+        // mount point. nbdkit keeps its own default when not set.
+        std::optional<uint32_t> httpConnections;
+
+        // Number of nbd-client connections, only Legacy mode supports more
+        // than one
+        uint32_t connections = 1;
+        // Proxy mode requests are coalesced into batches of up to this size
+        // on the way to the proxy, disabled when 0 (see proxy_relay.hpp)
+        uint32_t batchFlushKiB = 0;
+        // How long batch waits for more requests before it is sent
+        uint32_t batchFlushDelayUs = 0;
+        // Largest request kernel issues to the device (queue/max_sectors_kb)
+        std::optional<uint32_t> maxSectorsKiB;
+        // Keep USB gadget provisioned for whole daemon lifetime, only medium
+        // and UDC binding change on insertion and ejection
+        bool persistentGadget = false;
+        // Mount points naming the same gadget share it, each of them as one
+        // LUN (numbered in order of mount point names). Gadget persists like
+        // with persistentGadget.
+        std::optional<std::string> sharedGadget;
+        unsigned lun = 0;
+        // Share of I/O scheduler capacity relative to other mount points,
+        // built-in server only (see io_scheduler.hpp)
+        uint32_t ioWeight = 100;
+        // Bandwidth limit of the image, unlimited when 0. Burst defaults to
+        // one second worth of data.
+        uint32_t rateLimitKiBps = 0;
+        uint32_t rateBurstKiB = 0;
+        // Read-write Legacy mode mounts keep the image intact, writes go to
+        // delta file in this directory (see overlay.hpp)
+        std::optional<fs::path> overlayDirectory;
+        // CIFS client tunables for Legacy mode mounts ("Smb" object)
+        SmbShare::Options smb;
+        // Image is ejected after this long without any I/O, never when 0
+        // (top level "InactivityTimeout", common to all mount points)
+        std::chrono::seconds inactivityTimeout{0};
 
         static std::vector<std::string> toArgs(const MountPoint& mp)
         {
             std::vector<std::string> args = {
-                "-t", "30", "-u", mp.unixSocket, mp.nbdDevice.to_path(), "-n"};
+                "-t", std::to_string(mp.timeout.value_or(defaultTimeout)),
+                "-u", mp.unixSocket, mp.nbdDevice.to_path(), "-n"};
+            if (mp.blocksize)
+            {
+                args.insert(args.end(), {"-b", std::to_string(*mp.blocksize)});
+            }
+            if (mp.connections > 1 && mp.mode == Mode::legacy)
+            {
+                args.insert(args.end(), {"-C", std::to_string(mp.connections)});
+            }
             return args;
         }
+
+        static constexpr const int defaultTimeout = 30;
     };
 
     const MountPoint* getMountPoint(const std::string& name) const
@@ -59,13 +120,41 @@ class Configuration
 
     bool valid = false;
     boost::container::flat_map<std::string, MountPoint> mountPoints;
+    // Persistent cache of images served by built-in NBD server over HTTPS,
+    // disabled when size is 0
+    fs::path spillCacheDirectory = "/var/cache/virtual-media";
+    uint64_t spillCacheSizeMiB = 0;
+    // Backend requests of all mount points served by the daemon in flight
+    // at once, weighted fair queueing of the rest is disabled when 0
+    uint32_t ioSchedulerConcurrency = 0;
+    // Active sessions are journaled here to survive daemon restart, empty
+    // path disables it
+    fs::path sessionJournalDirectory = "/run/virtual-media";
+    // Time taken by loading and validation, part of reported startup time
+    std::chrono::microseconds loadTime{0};
 
     Configuration(const std::string& file)
     {
+        const auto started = std::chrono::steady_clock::now();
         valid = loadConfiguration(file);
+        loadTime = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started);
     }
 
   private:
+    static constexpr const uint64_t maxConnections = 16;
+    static constexpr const uint64_t maxBatchFlushKiB = 4096;
+    static constexpr const uint64_t maxBatchFlushDelayUs = 100000;
+    // Mass storage function supports up to 8 LUNs on older kernels
+    static constexpr const unsigned maxSharedGadgetLuns = 8;
+    static constexpr const uint64_t maxIoWeight = 10000;
+
+    // Kernel accepts power of 2 block sizes from 512 to page size
+    static bool isValidBlockSize(uint64_t size)
+    {
+        return size >= 512 && size <= 4096 && (size & (size - 1)) == 0;
+    }
+
     bool loadConfiguration(const std::string& file) noexcept
     {
         std::ifstream configFile(file);
@@ -74,9 +163,12 @@ class Configuration
             LogMsg(Logger::Critical, "Could not open configuration file");
             return false;
         }
+        // Parsing contiguous buffer avoids per character stream access
+        const std::string content(std::istreambuf_iterator<char>(configFile),
+                                  {});
         try
         {
-            auto data = nlohmann::json::parse(configFile, nullptr);
+            auto data = nlohmann::json::parse(content, nullptr);
             setupVariables(data);
         }
         catch (nlohmann::json::exception& e)
@@ -92,9 +184,88 @@ class Configuration
         return true;
     }
 
-    bool setupVariables(const nlohmann::json& config)
+    static bool parseSmbOptions(const nlohmann::json& smb,
+                                SmbShare::Options& options)
+    {
+        const auto versionIter = smb.find("Version");
+        if (versionIter != smb.cend())
+        {
+            const std::string* value = versionIter->get_ptr<const std::string*>();
+            if (!value || !SmbShare::Options::isValidVersion(*value))
+            {
+                LogMsg(Logger::Error, "Smb Version unrecognized.");
+                return false;
+            }
+            options.version = *value;
+        }
+        const auto cacheIter = smb.find("Cache");
+        if (cacheIter != smb.cend())
+        {
+            const std::string* value = cacheIter->get_ptr<const std::string*>();
+            if (!value || !SmbShare::Options::isValidCache(*value))
+            {
+                LogMsg(Logger::Error, "Smb Cache unrecognized.");
+                return false;
+            }
+            options.cache = *value;
+        }
+
+        const std::pair<const char*, std::optional<uint32_t>*> numbers[] = {
+            {"RSize", &options.rsize},
+            {"WSize", &options.wsize},
+            {"Actimeo", &options.actimeo}};
+        for (const auto& [key, option] : numbers)
+        {
+            const auto iter = smb.find(key);
+            if (iter == smb.cend())
+            {
+                continue;
+            }
+            const uint64_t* value = iter->get_ptr<const uint64_t*>();
+            if (!value || *value > std::numeric_limits<uint32_t>::max())
+            {
+                LogMsg(Logger::Error, "Smb ", key, " invalid.");
+                return false;
+            }
+            *option = static_cast<uint32_t>(*value);
+        }
+        return true;
+    }
+
+    void parseSpillCache(const nlohmann::json& cache)
     {
+        const auto directoryIter = cache.find("Directory");
+        if (directoryIter != cache.cend())
+        {
+            const std::string* value =
+                directoryIter->get_ptr<const std::string*>();
+            if (value && !value->empty())
+            {
+                spillCacheDirectory = *value;
+            }
+            else
+            {
+                LogMsg(Logger::Error, "SpillCache Directory invalid, use default");
+            }
+        }
+        const auto sizeIter = cache.find("SizeMiB");
+        if (sizeIter != cache.cend())
+        {
+            const uint64_t* value = sizeIter->get_ptr<const uint64_t*>();
+            if (value)
+            {
+                spillCacheSizeMiB = *value;
+            }
+            else
+            {
+                LogMsg(Logger::Error, "SpillCache SizeMiB invalid, cache disabled");
+            }
+        }
+    }
 
+    bool setupVariables(const nlohmann::json& config)
+    {
+        std::chrono::seconds inactivityTimeout{0};
         for (const auto& item : config.items())
         {
             if (item.key() == "MountPoints")
@@ -108,7 +279,11 @@ class Configuration
                     {
                         const std::string* value =
                             nbdDeviceIter->get_ptr<const std::string*>();
-                        if (value)
+                        if (value && *value == "auto")
+                        {
+                            mp.dynamicNbdDevice = true;
+                        }
+                        else if (value)
                         {
                             mp.nbdDevice = NBDDevice(value->c_str());
                             if (!mp.nbdDevice)
@@ -124,7 +299,13 @@ class Configuration
                                    "NBDDevice required, not set");
                             continue;
                         }
-                    };
+                    }
+                    else
+                    {
+                        LogMsg(Logger::Info,
+                               "NBDDevice not set, allocate on activation");
+                        mp.dynamicNbdDevice = true;
+                    }
                     const auto unixSocketIter =
                         mountpoint.value().find("UnixSocket");
                     if (unixSocketIter != mountpoint.value().cend())
@@ -180,16 +361,256 @@ class Configuration
                     {
                         const uint64_t* value =
                             blocksizeIter->get_ptr<const uint64_t*>();
-                        if (value)
+                        if (value && isValidBlockSize(*value))
                         {
                             mp.blocksize = *value;
                         }
+                        else if (value)
+                        {
+                            LogMsg(Logger::Error,
+                                   "BlockSize has to be power of 2 between "
+                                   "512 and 4096, use default");
+                        }
                         else
                         {
                             LogMsg(Logger::Info,
                                    "BlockSize not set, use default");
                         }
                     }
+                    const auto connectionsIter =
+                        mountpoint.value().find("Connections");
+                    if (connectionsIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            connectionsIter->get_ptr<const uint64_t*>();
+                        if (value && *value >= 1 && *value <= maxConnections)
+                        {
+                            mp.connections = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "Connections not set, use default");
+                        }
+                    }
+                    const auto httpConnectionsIter =
+                        mountpoint.value().find("HttpConnections");
+                    if (httpConnectionsIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            httpConnectionsIter->get_ptr<const uint64_t*>();
+                        if (value && *value >= 1 && *value <= maxConnections)
+                        {
+                            mp.httpConnections = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "HttpConnections invalid, use default");
+                        }
+                    }
+                    const auto weightIter =
+                        mountpoint.value().find("IoWeight");
+                    if (weightIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            weightIter->get_ptr<const uint64_t*>();
+                        if (value && *value >= 1 && *value <= maxIoWeight)
+                        {
+                            mp.ioWeight = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "IoWeight invalid, use default");
+                        }
+                    }
+                    const auto rateIter =
+                        mountpoint.value().find("RateLimitKiBps");
+                    if (rateIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            rateIter->get_ptr<const uint64_t*>();
+                        if (value && *value <= UINT32_MAX)
+                        {
+                            mp.rateLimitKiBps = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "RateLimitKiBps invalid, bandwidth "
+                                   "unlimited");
+                        }
+                    }
+                    const auto burstIter =
+                        mountpoint.value().find("RateBurstKiB");
+                    if (burstIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            burstIter->get_ptr<const uint64_t*>();
+                        if (value && *value <= UINT32_MAX)
+                        {
+                            mp.rateBurstKiB = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "RateBurstKiB invalid, use default");
+                        }
+                    }
+                    const auto batchIter =
+                        mountpoint.value().find("BatchFlushKiB");
+                    if (batchIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            batchIter->get_ptr<const uint64_t*>();
+                        if (value && *value <= maxBatchFlushKiB)
+                        {
+                            mp.batchFlushKiB = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "BatchFlushKiB invalid, batching disabled");
+                        }
+                    }
+                    const auto batchDelayIter =
+                        mountpoint.value().find("BatchFlushDelayUs");
+                    if (batchDelayIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            batchDelayIter->get_ptr<const uint64_t*>();
+                        if (value && *value <= maxBatchFlushDelayUs)
+                        {
+                            mp.batchFlushDelayUs = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "BatchFlushDelayUs invalid, use default");
+                        }
+                    }
+                    const auto maxSectorsIter =
+                        mountpoint.value().find("MaxSectorsKiB");
+                    if (maxSectorsIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            maxSectorsIter->get_ptr<const uint64_t*>();
+                        if (value && *value > 0)
+                        {
+                            mp.maxSectorsKiB = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "MaxSectorsKiB not set, use default");
+                        }
+                    }
+                    const auto builtinNbdServerIter =
+                        mountpoint.value().find("BuiltinNbdServer");
+                    if (builtinNbdServerIter != mountpoint.value().cend())
+                    {
+                        const bool* value =
+                            builtinNbdServerIter->get_ptr<const bool*>();
+                        if (value)
+                        {
+                            mp.builtinNbdServer = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "BuiltinNbdServer not set, use default");
+                        }
+                    }
+                    const auto cacheSizeIter =
+                        mountpoint.value().find("CacheSizeMiB");
+                    if (cacheSizeIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            cacheSizeIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.cacheSizeMiB = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "CacheSizeMiB not set, use default");
+                        }
+                    }
+                    const auto readAheadIter =
+                        mountpoint.value().find("ReadAheadKiB");
+                    if (readAheadIter != mountpoint.value().cend())
+                    {
+                        const uint64_t* value =
+                            readAheadIter->get_ptr<const uint64_t*>();
+                        if (value)
+                        {
+                            mp.readAheadKiB = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "ReadAheadKiB not set, use default");
+                        }
+                    }
+                    const auto smbIter = mountpoint.value().find("Smb");
+                    if (smbIter != mountpoint.value().cend())
+                    {
+                        if (!parseSmbOptions(*smbIter, mp.smb))
+                        {
+                            continue;
+                        }
+                    }
+                    const auto persistentGadgetIter =
+                        mountpoint.value().find("PersistentGadget");
+                    if (persistentGadgetIter != mountpoint.value().cend())
+                    {
+                        const bool* value =
+                            persistentGadgetIter->get_ptr<const bool*>();
+                        if (value)
+                        {
+                            mp.persistentGadget = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "PersistentGadget not set, use default");
+                        }
+                    }
+                    const auto sharedGadgetIter =
+                        mountpoint.value().find("SharedGadget");
+                    if (sharedGadgetIter != mountpoint.value().cend())
+                    {
+                        const std::string* value =
+                            sharedGadgetIter->get_ptr<const std::string*>();
+                        if (value && !value->empty())
+                        {
+                            mp.sharedGadget = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Error,
+                                   "SharedGadget invalid, use own gadget");
+                        }
+                    }
+                    const auto overlayIter =
+                        mountpoint.value().find("OverlayDirectory");
+                    if (overlayIter != mountpoint.value().cend())
+                    {
+                        const std::string* value =
+                            overlayIter->get_ptr<const std::string*>();
+                        if (value && !value->empty())
+                        {
+                            mp.overlayDirectory = *value;
+                        }
+                        else
+                        {
+                            LogMsg(Logger::Info,
+                                   "OverlayDirectory invalid, writes go to "
+                                   "the image");
+                        }
+                    }
                     const auto modeIter = mountpoint.value().find("Mode");
                     if (modeIter != mountpoint.value().cend())
                     {
@@ -228,6 +649,97 @@ class Configuration
                     mountPoints[mountpoint.key()] = std::move(mp);
                 }
             }
+            else if (item.key() == "InactivityTimeout")
+            {
+                const uint64_t* value =
+                    item.value().get_ptr<const uint64_t*>();
+                if (value)
+                {
+                    inactivityTimeout = std::chrono::seconds(*value);
+                }
+                else
+                {
+                    LogMsg(Logger::Error,
+                           "InactivityTimeout invalid, idle images stay");
+                }
+            }
+            else if (item.key() == "SpillCache")
+            {
+                parseSpillCache(item.value());
+            }
+            else if (item.key() == "IoSchedulerConcurrency")
+            {
+                const uint64_t* value =
+                    item.value().get_ptr<const uint64_t*>();
+                if (value && *value <= UINT32_MAX)
+                {
+                    ioSchedulerConcurrency = *value;
+                }
+                else
+                {
+                    LogMsg(Logger::Error,
+                           "IoSchedulerConcurrency invalid, scheduler "
+                           "disabled");
+                }
+            }
+            else if (item.key() == "SessionJournalDirectory")
+            {
+                const std::string* value =
+                    item.value().get_ptr<const std::string*>();
+                if (value)
+                {
+                    sessionJournalDirectory = *value;
+                }
+                else
+                {
+                    LogMsg(Logger::Error,
+                           "SessionJournalDirectory invalid, use default");
+                }
+            }
+            else if (item.key() == "LogLevel")
+            {
+                const std::string* value =
+                    item.value().get_ptr<const std::string*>();
+                const auto level =
+                    value ? Logger::levelFromName(*value) : std::nullopt;
+                if (level)
+                {
+                    Logger::setLevel(*level);
+                }
+                else
+                {
+                    LogMsg(Logger::Error, "LogLevel unrecognized, use default");
+                }
+            }
+        }
+        std::map<std::string, unsigned> sharedGadgetLuns;
+        for (auto& [name, mountPoint] : mountPoints)
+        {
+            mountPoint.inactivityTimeout = inactivityTimeout;
+            if (mountPoint.sharedGadget)
+            {
+                // Gadgets of other mount points are named after them
+                const auto owner = mountPoints.find(*mountPoint.sharedGadget);
+                if (owner != mountPoints.end() &&
+                    owner->second.sharedGadget != mountPoint.sharedGadget)
+                {
+                    LogMsg(Logger::Error, "SharedGadget ",
+                           *mountPoint.sharedGadget, " is taken, ", name,
+                           " uses own gadget");
+                    mountPoint.sharedGadget.reset();
+                    continue;
+                }
+                unsigned& luns = sharedGadgetLuns[*mountPoint.sharedGadget];
+                if (luns == maxSharedGadgetLuns)
+                {
+                    LogMsg(Logger::Error, "SharedGadget ",
+                           *mountPoint.sharedGadget, " is full, ", name,
+                           " uses own gadget");
+                    mountPoint.sharedGadget.reset();
+                    continue;
+                }
+                mountPoint.lun = luns++;
+            }
         }
         return true;
     }
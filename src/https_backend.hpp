@@ -0,0 +1,447 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd_server.hpp"
+#include "utils.hpp"
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl/ssl_stream.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <string>
+
+namespace nbd
+{
+
+// Serves remote image over HTTPS using range requests. Connections are kept
+// alive and reused between requests, at most maxConnections of them are open
+// and that many requests are in flight. Large reads are split into ranges
+// fetched in parallel. Like nbdkit curl plugin invoked with sslverify=false,
+// server certificate is not verified.
+class HttpsBackend : public Backend
+{
+    // Every step of connection setup and request is bounded by timeout,
+    // stalled server can't hold connection slot forever
+    using Stream = boost::beast::ssl_stream<boost::beast::tcp_stream>;
+
+    struct Connection
+    {
+        Connection(boost::asio::io_context& ioc,
+                   boost::asio::ssl::context& sslCtx) :
+            stream(ioc, sslCtx)
+        {}
+
+        Stream stream;
+        boost::beast::flat_buffer buffer;
+        bool reused = false;
+    };
+
+  public:
+    // Reads are not split into ranges smaller than this
+    static constexpr const size_t minPartSize = 128 * 1024;
+    // Longest resolve, connect, handshake, request write, response header
+    // or body read, whichever is running
+    static constexpr const std::chrono::seconds timeout{30};
+
+    HttpsBackend(
+        boost::asio::io_context& ioc, const std::string& url,
+        const std::unique_ptr<utils::CredentialsProvider>& credentials,
+        unsigned maxConnections = 1) :
+        ioc(ioc),
+        sslCtx(boost::asio::ssl::context::tls_client),
+        maxConnections(std::max(maxConnections, 1u)),
+        slots(ioc.get_executor(), this->maxConnections)
+    {
+        sslCtx.set_verify_mode(boost::asio::ssl::verify_none);
+        parseUrl(url);
+
+        if (credentials)
+        {
+            std::string userPass =
+                credentials->user() + ":" + credentials->password();
+            authorization = "Basic " + utils::base64Encode(userPass);
+            utils::secureCleanup(userPass);
+        }
+    }
+
+    ~HttpsBackend()
+    {
+        close();
+        utils::secureCleanup(authorization);
+    }
+
+    bool initialize(boost::asio::yield_context yield) override
+    {
+        // Single byte range request reveals both size of the image and
+        // whether server is able to serve ranges at all
+        char byte;
+        if (fetch(0, 1, &byte, &exportSize, yield) != 0)
+        {
+            LogMsg(Logger::Error, "[HttpsBackend]: Unable to access https://",
+                   hostHeader, target);
+            return false;
+        }
+        LogMsg(Logger::Debug, "[HttpsBackend]: Serving https://", hostHeader,
+               target, " size = ", exportSize);
+        return true;
+    }
+
+    void close() override
+    {
+        closed = true;
+        for (auto& weakConnection : connections)
+        {
+            if (auto connection = weakConnection.lock())
+            {
+                boost::system::error_code ignored_ec;
+                boost::beast::get_lowest_layer(connection->stream)
+                    .socket()
+                    .close(ignored_ec);
+            }
+        }
+        connections.clear();
+        idle.clear();
+    }
+
+    uint64_t size() const override
+    {
+        return exportSize;
+    }
+
+    // ETag, or Last-Modified when there is none, of the image as seen when
+    // initialized. Empty when server sends neither.
+    const std::string& validator() const
+    {
+        return imageValidator;
+    }
+
+    bool readOnly() const override
+    {
+        return true;
+    }
+
+    unsigned concurrency() const override
+    {
+        return maxConnections;
+    }
+
+    int read(uint64_t offset, char* data, size_t length,
+             boost::asio::yield_context yield) override
+    {
+        if (length == 0)
+        {
+            return 0;
+        }
+        const size_t parts =
+            std::min<size_t>(maxConnections, length / minPartSize);
+        if (parts < 2)
+        {
+            return fetch(offset, length, data, nullptr, yield);
+        }
+
+        // Round trips, not bandwidth, limit single connection on high
+        // latency links
+        const size_t partLength = (length + parts - 1) / parts;
+        auto done = std::make_shared<boost::asio::steady_timer>(
+            ioc, boost::asio::steady_timer::time_point::max());
+        size_t remaining = parts;
+        int result = 0;
+        for (size_t part = 0; part < parts; part++)
+        {
+            const size_t begin = part * partLength;
+            const size_t partSize = std::min(partLength, length - begin);
+            boost::asio::spawn(
+                ioc, [this, done, &remaining, &result, offset, data, begin,
+                      partSize](boost::asio::yield_context yield) {
+                    int error = fetch(offset + begin, partSize, data + begin,
+                                      nullptr, yield);
+                    if (error && !result)
+                    {
+                        result = error;
+                    }
+                    if (--remaining == 0)
+                    {
+                        done->cancel();
+                    }
+                });
+        }
+        if (remaining > 0)
+        {
+            boost::system::error_code ignored_ec;
+            done->async_wait(yield[ignored_ec]);
+        }
+        return result;
+    }
+
+  private:
+    void parseUrl(const std::string& url)
+    {
+        const std::string scheme = "https://";
+        std::string rest = url.substr(
+            url.compare(0, scheme.size(), scheme) == 0 ? scheme.size() : 0);
+
+        const auto slash = rest.find('/');
+        std::string authority = rest.substr(0, slash);
+        target = (slash == std::string::npos) ? "/" : rest.substr(slash);
+
+        // Credentials are never taken from URL
+        const auto at = authority.rfind('@');
+        if (at != std::string::npos)
+        {
+            authority = authority.substr(at + 1);
+        }
+        hostHeader = authority;
+
+        port = "443";
+        if (!authority.empty() && authority.front() == '[')
+        {
+            // IPv6 literal
+            const auto end = authority.find(']');
+            host = authority.substr(1, end - 1);
+            if (end != std::string::npos && end + 1 < authority.size() &&
+                authority[end + 1] == ':')
+            {
+                port = authority.substr(end + 2);
+            }
+        }
+        else
+        {
+            const auto colon = authority.rfind(':');
+            host = authority.substr(0, colon);
+            if (colon != std::string::npos)
+            {
+                port = authority.substr(colon + 1);
+            }
+        }
+    }
+
+    std::shared_ptr<Connection> connect(boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+        boost::asio::ip::tcp::resolver resolver(ioc);
+        boost::asio::steady_timer deadline(ioc, timeout);
+        deadline.async_wait([&resolver](const boost::system::error_code& ec) {
+            if (!ec)
+            {
+                resolver.cancel();
+            }
+        });
+        auto endpoints = resolver.async_resolve(host, port, yield[ec]);
+        deadline.cancel();
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[HttpsBackend]: Unable to resolve ", host,
+                   ": ", ec);
+            return {};
+        }
+
+        auto connection = std::make_shared<Connection>(ioc, sslCtx);
+        connections.remove_if(
+            [](const auto& connection) { return connection.expired(); });
+        connections.push_back(connection);
+
+        // Server Name Indication, required by most virtual hosts
+        SSL_set_tlsext_host_name(connection->stream.native_handle(),
+                                 host.c_str());
+
+        auto& tcp = boost::beast::get_lowest_layer(connection->stream);
+        tcp.expires_after(timeout);
+        tcp.async_connect(endpoints, yield[ec]);
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[HttpsBackend]: Unable to connect to ",
+                   host, ":", port, ": ", ec);
+            return {};
+        }
+        tcp.expires_after(timeout);
+        connection->stream.async_handshake(
+            boost::asio::ssl::stream_base::client, yield[ec]);
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[HttpsBackend]: TLS handshake with ", host,
+                   " failed: ", ec);
+            return {};
+        }
+        return connection;
+    }
+
+    std::shared_ptr<Connection> acquire(boost::asio::yield_context yield)
+    {
+        if (!idle.empty())
+        {
+            auto connection = std::move(idle.back());
+            idle.pop_back();
+            return connection;
+        }
+        return connect(yield);
+    }
+
+    static bool parseContentRange(const std::string& value, uint64_t& total)
+    {
+        // bytes <first>-<last>/<total>
+        const auto slash = value.rfind('/');
+        if (slash == std::string::npos)
+        {
+            return false;
+        }
+        const char* begin = value.data() + slash + 1;
+        const char* end = value.data() + value.size();
+        auto [ptr, ec] = std::from_chars(begin, end, total);
+        return ec == std::errc() && ptr == end;
+    }
+
+    // Waits for free connection slot, so the pool stays bounded
+    int fetch(uint64_t offset, size_t length, char* data, uint64_t* totalSize,
+              boost::asio::yield_context yield)
+    {
+        slots.acquire(yield);
+        int error = exchange(offset, length, data, totalSize, yield);
+        slots.release();
+        return error;
+    }
+
+    int exchange(uint64_t offset, size_t length, char* data,
+                 uint64_t* totalSize, boost::asio::yield_context yield)
+    {
+        namespace http = boost::beast::http;
+
+        // Second attempt covers keep-alive connections closed by server and
+        // requests timed out on stalled connection
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            if (closed)
+            {
+                return ESHUTDOWN;
+            }
+
+            auto connection = acquire(yield);
+            if (!connection)
+            {
+                return EIO;
+            }
+
+            http::request<http::empty_body> req{http::verb::get, target, 11};
+            req.set(http::field::host, hostHeader);
+            req.set(http::field::user_agent, "virtual-media");
+            req.set(http::field::range,
+                    "bytes=" + std::to_string(offset) + "-" +
+                        std::to_string(offset + length - 1));
+            if (!authorization.empty())
+            {
+                req.set(http::field::authorization, authorization);
+            }
+
+            auto& tcp = boost::beast::get_lowest_layer(connection->stream);
+            boost::system::error_code ec;
+            tcp.expires_after(timeout);
+            http::async_write(connection->stream, req, yield[ec]);
+
+            http::response_parser<http::string_body> parser;
+            parser.body_limit(length);
+            if (!ec)
+            {
+                tcp.expires_after(timeout);
+                http::async_read_header(connection->stream,
+                                        connection->buffer, parser, yield[ec]);
+            }
+            if (ec)
+            {
+                if (connection->reused || ec == boost::beast::error::timeout)
+                {
+                    // Other idle connections outlived the same keep-alive
+                    // timeout, retry goes over new one
+                    idle.clear();
+                    continue;
+                }
+                LogMsg(Logger::Error, "[HttpsBackend]: Request failed: ", ec);
+                return EIO;
+            }
+
+            if (parser.get().result() != http::status::partial_content)
+            {
+                LogMsg(Logger::Error,
+                       "[HttpsBackend]: Unexpected response to range request: ",
+                       parser.get().result_int());
+                return EIO;
+            }
+
+            tcp.expires_after(timeout);
+            http::async_read(connection->stream, connection->buffer, parser,
+                             yield[ec]);
+            if (ec == boost::beast::error::timeout)
+            {
+                LogMsg(Logger::Error,
+                       "[HttpsBackend]: Response timed out, retrying");
+                idle.clear();
+                continue;
+            }
+            if (ec)
+            {
+                LogMsg(Logger::Error, "[HttpsBackend]: Reading response failed: ",
+                       ec);
+                return EIO;
+            }
+
+            const auto& res = parser.get();
+            if (res.body().size() != length)
+            {
+                LogMsg(Logger::Error, "[HttpsBackend]: Got ",
+                       res.body().size(), " bytes, expected ", length);
+                return EIO;
+            }
+            if (totalSize &&
+                !parseContentRange(
+                    std::string(res[http::field::content_range]), *totalSize))
+            {
+                LogMsg(Logger::Error,
+                       "[HttpsBackend]: Invalid Content-Range header");
+                return EIO;
+            }
+            if (totalSize)
+            {
+                imageValidator = std::string(res[http::field::etag]);
+                if (imageValidator.empty())
+                {
+                    imageValidator = std::string(res[http::field::last_modified]);
+                }
+            }
+            std::memcpy(data, res.body().data(), length);
+
+            if (res.keep_alive() && !closed)
+            {
+                connection->reused = true;
+                idle.push_back(std::move(connection));
+            }
+            return 0;
+        }
+        return EIO;
+    }
+
+    boost::asio::io_context& ioc;
+    boost::asio::ssl::context sslCtx;
+    std::string host;
+    std::string port;
+    std::string hostHeader;
+    std::string target;
+    std::string authorization;
+    uint64_t exportSize = 0;
+    std::string imageValidator;
+    bool closed = false;
+    unsigned maxConnections;
+    Semaphore slots;
+
+    std::vector<std::shared_ptr<Connection>> idle;
+    std::list<std::weak_ptr<Connection>> connections;
+};
+
+} // namespace nbd
@@ -0,0 +1,276 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd_server.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <utility>
+
+namespace nbd
+{
+
+// Shares backend I/O capacity of all mount points served by the daemon.
+// Requests over the concurrency limit queue up and are started in weighted
+// fair queueing order: every request is tagged with virtual finish time,
+// advancing by its length divided by weight of its flow, and smallest tag
+// goes first (self-clocked, virtual time is tag of last started request).
+class IoScheduler
+{
+  public:
+    static std::unique_ptr<IoScheduler> create(boost::asio::io_context& ioc,
+                                               unsigned concurrency)
+    {
+        auto scheduler =
+            std::unique_ptr<IoScheduler>(new IoScheduler(ioc, concurrency));
+        current = scheduler.get();
+        LogMsg(Logger::Info, "[IoScheduler]: Up to ", concurrency,
+               " requests in flight");
+        return scheduler;
+    }
+
+    ~IoScheduler()
+    {
+        current = nullptr;
+    }
+
+    IoScheduler(const IoScheduler&) = delete;
+    IoScheduler& operator=(const IoScheduler&) = delete;
+
+    static IoScheduler* instance()
+    {
+        return current;
+    }
+
+    // I/O of single mount point. Token bucket, when rate is set, limits its
+    // bandwidth independently of other flows. Without scheduler instance
+    // only the bucket applies.
+    class Flow
+    {
+      public:
+        Flow(boost::asio::io_context& ioc, unsigned weight, uint64_t rate,
+             uint64_t burst) :
+            ioc(ioc),
+            weight(std::max(1u, weight)), rate(rate),
+            burst(std::max(burst, uint64_t(1))), tokens(double(this->burst)),
+            refilled(std::chrono::steady_clock::now())
+        {}
+
+        // Suspends until request of given length may be issued, every
+        // acquire has to be followed by release
+        void acquire(size_t length, boost::asio::yield_context yield)
+        {
+            queued++;
+            if (rate)
+            {
+                throttle(length, yield);
+            }
+            if (auto scheduler = IoScheduler::instance())
+            {
+                const double start = std::max(scheduler->virtualTime, finish);
+                finish = start + double(length) / weight;
+                scheduler->acquire(finish, yield);
+            }
+            queued--;
+        }
+
+        void release()
+        {
+            if (auto scheduler = IoScheduler::instance())
+            {
+                scheduler->release();
+            }
+        }
+
+        // Requests waiting for bandwidth or their turn
+        unsigned queueDepth() const
+        {
+            return queued;
+        }
+
+        bool throttled() const
+        {
+            return waitingForTokens;
+        }
+
+      private:
+        // Requests larger than burst wait for full bucket and leave it in
+        // debt, so long term rate holds for any request size
+        void throttle(size_t length, boost::asio::yield_context yield)
+        {
+            const double needed = double(std::min<uint64_t>(length, burst));
+            refill();
+            while (tokens < needed)
+            {
+                waitingForTokens = true;
+                boost::asio::steady_timer timer(
+                    ioc, std::chrono::microseconds(static_cast<int64_t>(
+                             (needed - tokens) * 1e6 / double(rate)) + 1));
+                boost::system::error_code ignored_ec;
+                timer.async_wait(yield[ignored_ec]);
+                refill();
+            }
+            waitingForTokens = false;
+            tokens -= double(length);
+        }
+
+        void refill()
+        {
+            const auto now = std::chrono::steady_clock::now();
+            const double elapsed =
+                std::chrono::duration<double>(now - refilled).count();
+            refilled = now;
+            tokens = std::min(double(burst), tokens + elapsed * double(rate));
+        }
+
+        boost::asio::io_context& ioc;
+        unsigned weight;
+        // Bytes per second, unlimited when 0
+        uint64_t rate;
+        uint64_t burst;
+        double tokens;
+        std::chrono::steady_clock::time_point refilled;
+        double finish = 0;
+        unsigned queued = 0;
+        bool waitingForTokens = false;
+    };
+
+  private:
+    IoScheduler(boost::asio::io_context& ioc, unsigned concurrency) :
+        ioc(ioc), available(std::max(1u, concurrency))
+    {}
+
+    void acquire(double tag, boost::asio::yield_context yield)
+    {
+        if (available > 0 && waiters.empty())
+        {
+            available--;
+            virtualTime = tag;
+            return;
+        }
+        // Timer on coroutine stack, cancelled when slot is handed over
+        boost::asio::steady_timer wake(
+            ioc, boost::asio::steady_timer::time_point::max());
+        waiters.emplace(std::make_pair(tag, sequence++), &wake);
+        boost::system::error_code ignored_ec;
+        wake.async_wait(yield[ignored_ec]);
+    }
+
+    void release()
+    {
+        if (waiters.empty())
+        {
+            available++;
+            return;
+        }
+        auto next = waiters.begin();
+        virtualTime = next->first.first;
+        next->second->cancel();
+        waiters.erase(next);
+    }
+
+    static inline IoScheduler* current = nullptr;
+
+    boost::asio::io_context& ioc;
+    unsigned available;
+    double virtualTime = 0;
+    // Ties are broken by arrival
+    uint64_t sequence = 0;
+    std::map<std::pair<double, uint64_t>, boost::asio::steady_timer*> waiters;
+};
+
+// Passes every request of inner backend through flow of the mount point
+class ScheduledBackend : public Backend
+{
+  public:
+    ScheduledBackend(std::shared_ptr<Backend> inner,
+                     std::shared_ptr<IoScheduler::Flow> flow) :
+        inner(std::move(inner)),
+        flow(std::move(flow))
+    {}
+
+    bool initialize(boost::asio::yield_context yield) override
+    {
+        return inner->initialize(yield);
+    }
+
+    void close() override
+    {
+        inner->close();
+    }
+
+    uint64_t size() const override
+    {
+        return inner->size();
+    }
+
+    bool readOnly() const override
+    {
+        return inner->readOnly();
+    }
+
+    unsigned concurrency() const override
+    {
+        return inner->concurrency();
+    }
+
+    int read(uint64_t offset, char* data, size_t length,
+             boost::asio::yield_context yield) override
+    {
+        Slot slot(*flow, length, yield);
+        return inner->read(offset, data, length, yield);
+    }
+
+    int write(uint64_t offset, const char* data, size_t length,
+              boost::asio::yield_context yield) override
+    {
+        Slot slot(*flow, length, yield);
+        return inner->write(offset, data, length, yield);
+    }
+
+    int flush(boost::asio::yield_context yield) override
+    {
+        return inner->flush(yield);
+    }
+
+    bool canSend() const override
+    {
+        return inner->canSend();
+    }
+
+    int send(int socket, const ReplyHeader& header, uint64_t offset,
+             size_t length, boost::asio::yield_context yield) override
+    {
+        Slot slot(*flow, length, yield);
+        return inner->send(socket, header, offset, length, yield);
+    }
+
+  private:
+    struct Slot
+    {
+        Slot(IoScheduler::Flow& flow, size_t length,
+             boost::asio::yield_context yield) :
+            flow(flow)
+        {
+            flow.acquire(length, yield);
+        }
+
+        ~Slot()
+        {
+            flow.release();
+        }
+
+        IoScheduler::Flow& flow;
+    };
+
+    std::shared_ptr<Backend> inner;
+    std::shared_ptr<IoScheduler::Flow> flow;
+};
+
+} // namespace nbd
@@ -0,0 +1,435 @@
+#pragma once
+
+#ifdef VM_IO_URING
+
+#include "logger.hpp"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+
+// Submission and completion rings shared with the kernel, used by file backed
+// NBD exports instead of worker threads. Requests queued during one event
+// loop iteration are submitted with single io_uring_enter, completions are
+// signalled through eventfd watched by the event loop. Rings are set up with
+// plain system calls, no liburing is needed.
+class IoUring
+{
+  public:
+    static constexpr const unsigned entries = 64;
+    // Registered buffers, reads bigger than that don't use them
+    static constexpr const size_t fixedBufferSize = 1024 * 1024;
+    static constexpr const unsigned fixedBufferCount = 8;
+
+    struct Request
+    {
+        uint8_t opcode;
+        int fd;
+        const void* address;
+        uint32_t length;
+        uint64_t offset = 0;
+        // Registered buffer (READ_FIXED) or message flags (SENDMSG)
+        uint16_t bufferIndex = 0;
+        uint32_t messageFlags = 0;
+    };
+
+    // Returns nullptr when kernel does not support everything needed, so
+    // caller stays with the asio reactor and worker threads
+    static std::unique_ptr<IoUring> create(boost::asio::io_context& ioc)
+    {
+        std::unique_ptr<IoUring> ring(new IoUring(ioc));
+        if (!ring->setup())
+        {
+            LogMsg(Logger::Info,
+                   "[IoUring]: Not available, using worker threads");
+            return {};
+        }
+        current = ring.get();
+        return ring;
+    }
+
+    static IoUring* instance()
+    {
+        return current;
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring()
+    {
+        if (current == this)
+        {
+            current = nullptr;
+        }
+        boost::system::error_code ignored_ec;
+        notifier.close(ignored_ec);
+        if (buffers != MAP_FAILED)
+        {
+            ::munmap(buffers, fixedBufferSize * fixedBufferCount);
+        }
+        if (sqes != MAP_FAILED)
+        {
+            ::munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+        {
+            ::munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED)
+        {
+            ::munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0)
+        {
+            ::close(ringFd);
+        }
+    }
+
+    bool hasFixedBuffers() const
+    {
+        return fixedBuffers;
+    }
+
+    std::optional<uint16_t> acquireBuffer()
+    {
+        for (uint16_t index = 0; index < fixedBufferCount; index++)
+        {
+            if (!(usedBuffers & (1u << index)))
+            {
+                usedBuffers |= 1u << index;
+                return index;
+            }
+        }
+        return {};
+    }
+
+    void releaseBuffer(uint16_t index)
+    {
+        usedBuffers &= ~(1u << index);
+    }
+
+    char* buffer(uint16_t index) const
+    {
+        return static_cast<char*>(buffers) + index * fixedBufferSize;
+    }
+
+    // Submits requests as linked chain (each starts only when previous one
+    // fully succeeded) and suspends until all of them complete. Results are
+    // as returned by kernel: transferred bytes or negative errno, requests
+    // skipped because of broken chain end with -ECANCELED.
+    template <size_t N>
+    std::array<int, N> run(const std::array<Request, N>& chain,
+                           boost::asio::yield_context yield)
+    {
+        using Results = std::array<int, N>;
+        return boost::asio::async_initiate<boost::asio::yield_context,
+                                           void(Results)>(
+            [this, &chain](auto handler) {
+                using Handler = decltype(handler);
+                struct Pending
+                {
+                    Pending(Handler&& handler) : handler(std::move(handler))
+                    {}
+                    Handler handler;
+                    Results results{};
+                    size_t remaining = N;
+                };
+                auto pending = std::make_shared<Pending>(std::move(handler));
+                // Chain can't be split between two submissions
+                if (sqEntries - (*sqTail - std::atomic_ref(*sqHead).load(
+                                              std::memory_order_acquire)) <
+                    N)
+                {
+                    submit();
+                }
+                for (size_t i = 0; i < N; i++)
+                {
+                    enqueue(chain[i], i + 1 < N,
+                            [this, pending, i](int result) {
+                                pending->results[i] = result;
+                                if (--pending->remaining == 0)
+                                {
+                                    boost::asio::post(ioc, [pending]() {
+                                        pending->handler(pending->results);
+                                    });
+                                }
+                            });
+                }
+            },
+            yield);
+    }
+
+  private:
+    using Completion = std::function<void(int)>;
+
+    IoUring(boost::asio::io_context& ioc) : ioc(ioc), notifier(ioc)
+    {}
+
+    bool setup()
+    {
+        io_uring_params params{};
+        ringFd = static_cast<int>(
+            ::syscall(__NR_io_uring_setup, entries, &params));
+        if (ringFd < 0)
+        {
+            LogMsg(Logger::Debug, "[IoUring]: Setup failed, errno = ", errno);
+            return false;
+        }
+        // Fast poll lets kernel wait for non-blocking socket on its own
+        const uint32_t required = IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+        if ((params.features & required) != required || !supportsOperations())
+        {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqRingSize =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap)
+        {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+        {
+            return false;
+        }
+        cqRing = singleMmap ? sqRing
+                            : ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ringFd,
+                                     IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (cqRing == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            return false;
+        }
+
+        auto* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        auto* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        const int event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event < 0 || registerRing(IORING_REGISTER_EVENTFD, &event, 1) < 0)
+        {
+            if (event >= 0)
+            {
+                ::close(event);
+            }
+            return false;
+        }
+        notifier.assign(event);
+        registerBuffers();
+        waitForCompletions();
+
+        LogMsg(Logger::Info, "[IoUring]: Using io_uring, fixed buffers: ",
+               fixedBuffers);
+        return true;
+    }
+
+    bool supportsOperations()
+    {
+        std::array<char, sizeof(io_uring_probe) +
+                             IORING_OP_LAST * sizeof(io_uring_probe_op)>
+            storage{};
+        auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (registerRing(IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+        {
+            return false;
+        }
+        for (uint8_t op : {IORING_OP_READ, IORING_OP_WRITE,
+                           IORING_OP_READ_FIXED, IORING_OP_SENDMSG})
+        {
+            if (op > probe->last_op ||
+                !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Not fatal, locked memory limit may not allow it
+    void registerBuffers()
+    {
+        buffers = ::mmap(nullptr, fixedBufferSize * fixedBufferCount,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+        if (buffers == MAP_FAILED)
+        {
+            return;
+        }
+        std::array<iovec, fixedBufferCount> iovecs;
+        for (unsigned i = 0; i < fixedBufferCount; i++)
+        {
+            iovecs[i] = {buffer(static_cast<uint16_t>(i)), fixedBufferSize};
+        }
+        if (registerRing(IORING_REGISTER_BUFFERS, iovecs.data(),
+                         fixedBufferCount) < 0)
+        {
+            LogMsg(Logger::Info, "[IoUring]: Unable to register buffers, "
+                                 "errno = ",
+                   errno);
+            return;
+        }
+        fixedBuffers = true;
+    }
+
+    int registerRing(unsigned opcode, const void* arg, unsigned count)
+    {
+        return static_cast<int>(
+            ::syscall(__NR_io_uring_register, ringFd, opcode, arg, count));
+    }
+
+    void enqueue(const Request& request, bool link, Completion&& completion)
+    {
+        const uint32_t tail = *sqTail;
+        const uint32_t index = tail & sqMask;
+        io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+        sqe = {};
+        sqe.opcode = request.opcode;
+        sqe.fd = request.fd;
+        sqe.addr = reinterpret_cast<uint64_t>(request.address);
+        sqe.len = request.length;
+        sqe.off = request.offset;
+        if (request.opcode == IORING_OP_READ_FIXED)
+        {
+            sqe.buf_index = request.bufferIndex;
+        }
+        sqe.msg_flags = request.messageFlags;
+        sqe.flags = link ? IOSQE_IO_LINK : 0;
+        sqe.user_data =
+            reinterpret_cast<uint64_t>(new Completion(std::move(completion)));
+        sqArray[index] = index;
+        std::atomic_ref(*sqTail).store(tail + 1, std::memory_order_release);
+        queued++;
+
+        // Everything queued until event loop gets back here goes at once
+        if (!submitScheduled)
+        {
+            submitScheduled = true;
+            boost::asio::post(ioc, [this]() {
+                submitScheduled = false;
+                submit();
+            });
+        }
+    }
+
+    void submit()
+    {
+        while (queued > 0)
+        {
+            const int ret = static_cast<int>(::syscall(
+                __NR_io_uring_enter, ringFd, queued, 0, 0, nullptr, 0));
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // Completion ring is full, reap and retry
+                if (errno == EBUSY || errno == EAGAIN)
+                {
+                    reap();
+                    continue;
+                }
+                LogMsg(Logger::Critical, "[IoUring]: Submission failed, "
+                                         "errno = ",
+                       errno);
+                return;
+            }
+            queued -= static_cast<unsigned>(ret);
+        }
+    }
+
+    void waitForCompletions()
+    {
+        notifier.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            [this](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    return;
+                }
+                uint64_t count;
+                [[maybe_unused]] auto ret =
+                    ::read(notifier.native_handle(), &count, sizeof(count));
+                reap();
+                waitForCompletions();
+            });
+    }
+
+    void reap()
+    {
+        uint32_t head = *cqHead;
+        const uint32_t tail =
+            std::atomic_ref(*cqTail).load(std::memory_order_acquire);
+        while (head != tail)
+        {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            std::unique_ptr<Completion> completion(
+                reinterpret_cast<Completion*>(cqe.user_data));
+            const int result = cqe.res;
+            head++;
+            std::atomic_ref(*cqHead).store(head, std::memory_order_release);
+            (*completion)(result);
+        }
+    }
+
+    static inline IoUring* current = nullptr;
+
+    boost::asio::io_context& ioc;
+    boost::asio::posix::stream_descriptor notifier;
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    void* buffers = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+    uint32_t* sqHead = nullptr;
+    uint32_t* sqTail = nullptr;
+    uint32_t* sqArray = nullptr;
+    uint32_t sqMask = 0;
+    uint32_t sqEntries = 0;
+    uint32_t* cqHead = nullptr;
+    uint32_t* cqTail = nullptr;
+    uint32_t cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned queued = 0;
+    bool submitScheduled = false;
+    bool fixedBuffers = false;
+    uint32_t usedBuffers = 0;
+};
+
+#endif
@@ -1,8 +1,21 @@
 #pragma once
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+// Most verbose level compiled in, runtime level can only be lower
 #define LOG_LEVEL Debug
 
 namespace Logger
@@ -44,6 +57,201 @@ struct Critical
     constexpr static const char* name = "Critical";
 };
 
+// Level names as used in configuration and on D-Bus
+static constexpr const char* levelNames[] = {
+    "", "Critical", "Error", "Warning", "Info", "Debug", "Struct"};
+
+static std::optional<int32_t> levelFromName(std::string_view name)
+{
+    for (int32_t level = Critical::value; level <= Struct::value; level++)
+    {
+        if (name == levelNames[level])
+        {
+            return level;
+        }
+    }
+    return {};
+}
+
+inline std::atomic<int32_t> runtimeLevel{LOG_LEVEL::value};
+
+static void setLevel(int32_t level)
+{
+    runtimeLevel.store(std::clamp(level, Critical::value, LOG_LEVEL::value),
+                       std::memory_order_relaxed);
+}
+
+static int32_t level()
+{
+    return runtimeLevel.load(std::memory_order_relaxed);
+}
+
+template <typename LogLevel>
+inline bool enabled()
+{
+    if constexpr (LogLevel::value > LOG_LEVEL::value)
+    {
+        return false;
+    }
+    else
+    {
+        return LogLevel::value <= runtimeLevel.load(std::memory_order_relaxed);
+    }
+}
+
+// Bounded ring of formatted lines with multiple producers (event loop and
+// worker threads) and single consumer, written out in batches by background
+// thread. Producers never block nor issue system calls on the fast path;
+// when ring is full the message is dropped and counted instead.
+class Sink
+{
+  public:
+    static constexpr const size_t slots = 512;
+    static constexpr const size_t lineSize = 512;
+
+    static Sink& instance()
+    {
+        static Sink sink;
+        return sink;
+    }
+
+    void push(std::string_view line)
+    {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot& slot = ring[pos % slots];
+            const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == pos)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (sequence < pos)
+            {
+                // Slot not drained yet, ring is full
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+            {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        Slot& slot = ring[pos % slots];
+        slot.length = std::min(line.size(), lineSize);
+        std::memcpy(slot.data, line.data(), slot.length);
+        slot.sequence.store(pos + 1, std::memory_order_release);
+
+        published.fetch_add(1, std::memory_order_release);
+        published.notify_one();
+    }
+
+  private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        size_t length = 0;
+        char data[lineSize];
+    };
+
+    Sink()
+    {
+        for (size_t i = 0; i < slots; i++)
+        {
+            ring[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        drainer = std::thread([this]() { drain(); });
+    }
+
+    ~Sink()
+    {
+        stopping.store(true, std::memory_order_release);
+        published.fetch_add(1, std::memory_order_release);
+        published.notify_one();
+        drainer.join();
+    }
+
+    void drain()
+    {
+        static constexpr const size_t batchSize = 16 * 1024;
+        std::string batch;
+        batch.reserve(batchSize + lineSize + 1);
+        size_t tail = 0;
+
+        while (true)
+        {
+            const uint32_t seen = published.load(std::memory_order_acquire);
+            const bool stop = stopping.load(std::memory_order_acquire);
+            size_t read = 0;
+
+            Slot* slot = &ring[tail % slots];
+            while (slot->sequence.load(std::memory_order_acquire) == tail + 1)
+            {
+                batch.append(slot->data, slot->length);
+                batch += '\n';
+                slot->sequence.store(tail + slots, std::memory_order_release);
+                slot = &ring[++tail % slots];
+                read++;
+                if (batch.size() >= batchSize)
+                {
+                    flush(batch);
+                }
+            }
+
+            const uint64_t lost =
+                dropped.exchange(0, std::memory_order_relaxed);
+            if (lost)
+            {
+                batch += "[Warning ] " + std::to_string(lost) +
+                         " log messages dropped\n";
+            }
+            flush(batch);
+
+            if (read == 0)
+            {
+                if (stop)
+                {
+                    return;
+                }
+                published.wait(seen, std::memory_order_acquire);
+            }
+        }
+    }
+
+    static void flush(std::string& batch)
+    {
+        const char* data = batch.data();
+        size_t length = batch.size();
+        while (length > 0)
+        {
+            ssize_t ret = ::write(STDOUT_FILENO, data, length);
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ret <= 0)
+            {
+                break;
+            }
+            data += ret;
+            length -= static_cast<size_t>(ret);
+        }
+        batch.clear();
+    }
+
+    Slot ring[slots];
+    std::atomic<size_t> head{0};
+    std::atomic<uint32_t> published{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> stopping{false};
+    std::thread drainer;
+};
+
 template <std::size_t Len>
 constexpr const char* baseNameImpl(const char (&str)[Len], std::size_t pos)
 {
@@ -70,26 +278,36 @@ std::ostream& operator<<(std::ostream& os, const std::vector<T>& v)
 }
 
 template <typename DefinedLogLevel, typename LogLevel, typename... Args>
-constexpr void logImpl(const char* file, int32_t line, const char* fname,
-                       Args&&... args)
+void logImpl(const char* file, int32_t line, const char* fname, Args&&... args)
 {
     if constexpr (LogLevel::value <= DefinedLogLevel::value)
     {
-        std::cout << "[" << LogLevel::name << "] [" << file << ":" << line
-                  << "] " << fname << "(): ";
-        (std::cout << ... << args) << std::endl;
+        // Formatting buffer is reused, so logging does not allocate each time
+        thread_local std::ostringstream stream;
+        stream.str("");
+        stream.clear();
+        stream << "[" << LogLevel::name << "] [" << file << ":" << line
+               << "] " << fname << "(): ";
+        (stream << ... << args);
+        Sink::instance().push(stream.view());
     }
 }
 
 template <typename LogLevel, typename... Args>
-constexpr void log(const char* file, int32_t line, const char* fname,
-                   Args&&... args)
+void log(const char* file, int32_t line, const char* fname, Args&&... args)
 {
     logImpl<LOG_LEVEL, LogLevel>(file, line, fname, args...);
 }
 
+// Arguments are not even evaluated when level is disabled
 #define LogMsg(level, ...)                                                     \
-    Logger::log<level>(Logger::baseName(__FILE__), __LINE__, __FUNCTION__,     \
-                       __VA_ARGS__)
+    do                                                                         \
+    {                                                                          \
+        if (Logger::enabled<level>())                                          \
+        {                                                                      \
+            Logger::log<level>(Logger::baseName(__FILE__), __LINE__,           \
+                               __FUNCTION__, __VA_ARGS__);                     \
+        }                                                                      \
+    } while (0)
 
 } // namespace Logger
@@ -1,5 +1,6 @@
 #include "configuration.hpp"
 #include "logger.hpp"
+#include "session_journal.hpp"
 #include "state_machine.hpp"
 #include "system.hpp"
 
@@ -12,8 +13,10 @@
 #include <boost/container/flat_map.hpp>
 #include <boost/container/flat_set.hpp>
 #include <boost/process.hpp>
+#include <csignal>
 #include <filesystem>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <sdbusplus/asio/connection.hpp>
@@ -24,9 +27,10 @@ class App
   public:
     App(boost::asio::io_context& ioc, const Configuration& config,
         sd_bus* custom_bus = nullptr) :
-        ioc(ioc),
-        devMonitor(ioc), config(config)
+        smbShares(ioc, workers),
+        ioc(ioc), devMonitor(ioc), config(config)
     {
+        const auto started = std::chrono::steady_clock::now();
         if (!custom_bus)
         {
             bus = std::make_shared<sdbusplus::asio::connection>(ioc);
@@ -37,26 +41,211 @@ class App
                 std::make_shared<sdbusplus::asio::connection>(ioc, custom_bus);
         }
         objServer = std::make_shared<sdbusplus::asio::object_server>(bus);
-        bus->request_name("xyz.openbmc_project.VirtualMedia");
         objManager = std::make_shared<sdbusplus::server::manager::manager>(
             *bus, "/xyz/openbmc_project/VirtualMedia");
 
+        addLoggingInterface();
+        addTraceInterface();
+        addStartupInterface();
+
+#ifdef VM_IO_URING
+        // Falls back to worker threads when kernel lacks support
+        ring = IoUring::create(ioc);
+#endif
+        if (config.spillCacheSizeMiB)
+        {
+            spillCache = nbd::SpillCache::create(
+                ioc, config.spillCacheDirectory,
+                config.spillCacheSizeMiB * 1024 * 1024, workers);
+        }
+
+        if (config.ioSchedulerConcurrency)
+        {
+            ioScheduler = nbd::IoScheduler::create(
+                ioc, config.ioSchedulerConcurrency);
+        }
+
+        SessionJournal::setDirectory(config.sessionJournalDirectory);
+        {
+            std::vector<std::string> slots;
+            for (const auto& [name, entry] : config.mountPoints)
+            {
+                slots.push_back(name);
+            }
+            SessionJournal::reapOrphans(slots);
+        }
         for (const auto& [name, entry] : config.mountPoints)
         {
             mpsm[name] = std::make_shared<MountPointStateMachine>(
-                ioc, devMonitor, name, entry, bus);
+                ioc, devMonitor, ports, nbdDevices, workers, smbShares, name,
+                entry, bus);
             mpsm[name]->emitRegisterDBusEvent(objServer);
         }
+        // Workaround for HSD18020136609 (see system.hpp) has to cover devices
+        // allocated dynamically later on as well
+        for (const auto& device : nbdDevices.freeDevices())
+        {
+            UdevGadget::forceUdevChange(device);
+        }
+
+        devMonitor.onUdcChange(
+            [this](const std::string& port, const std::string& function) {
+                ports.update(port, function);
+            });
+        devMonitor.run();
+        registrationTime = elapsedSince(started);
+        provisionGadgets();
+    }
+
+    ~App()
+    {
+        // Queued work (eg. gadget provisioning) refers to members below
+        workers.join();
+    }
+
+  private:
+    static std::chrono::microseconds
+        elapsedSince(std::chrono::steady_clock::time_point time)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - time);
+    }
+
+    // Persistent gadgets are provisioned on worker threads in parallel, each
+    // slot has its own configfs tree. Bus name is requested once all slots
+    // are complete, so name appearing on the bus means daemon is ready and
+    // single GetManagedObjects returns everything.
+    void provisionGadgets()
+    {
+        const auto started = std::chrono::steady_clock::now();
+        auto remaining = std::make_shared<size_t>(1);
+        auto done = [this, remaining, started]() {
+            if (--*remaining == 0)
+            {
+                provisioningTime = elapsedSince(started);
+                publish();
+            }
+        };
 
-        devMonitor.run([this](const NBDDevice& device, StateChange change) {
-            for (auto& [name, entry] : mpsm)
+        // LUNs of every shared gadget, marked when used by adopted session
+        std::map<std::string, std::vector<bool>> sharedGadgets;
+        for (const auto& [name, machine] : mpsm)
+        {
+            if (machine->config.sharedGadget)
             {
-                entry->emitUdevStateChangeEvent(device, change);
+                auto& luns = sharedGadgets[*machine->config.sharedGadget];
+                luns.resize(std::max<size_t>(luns.size(),
+                                             machine->config.lun + 1));
+                luns[machine->config.lun] = machine->hasSession();
+                continue;
             }
-        });
+            if (!machine->needsProvisioning())
+            {
+                continue;
+            }
+            ++*remaining;
+            boost::asio::spawn(ioc, [this, name = name, done](
+                                        boost::asio::yield_context yield) {
+                // Failure is not fatal, attaching retries provisioning
+                runBlocking(
+                    workers.executor(),
+                    [this, &name]() { return UsbGadget::provision(ports, name); },
+                    yield);
+                done();
+            });
+        }
+        for (auto& [name, luns] : sharedGadgets)
+        {
+            ++*remaining;
+            boost::asio::spawn(ioc, [this, name = name, luns = std::move(luns),
+                                     done](boost::asio::yield_context yield) {
+                // Shared gadget is never created on demand, failure leaves
+                // its mount points unable to attach
+                runBlocking(
+                    workers.executor(),
+                    [this, &name, &luns]() {
+                        return UsbGadget::provisionShared(ports, name, luns);
+                    },
+                    yield);
+                done();
+            });
+        }
+        done();
     }
 
-  private:
+    void publish()
+    {
+        bus->request_name("xyz.openbmc_project.VirtualMedia");
+        const auto total = config.loadTime + registrationTime + provisioningTime;
+        startupIface->set_property("ConfigurationTimeUs",
+                                   uint64_t(config.loadTime.count()));
+        startupIface->set_property("RegistrationTimeUs",
+                                   uint64_t(registrationTime.count()));
+        startupIface->set_property("ProvisioningTimeUs",
+                                   uint64_t(provisioningTime.count()));
+        startupIface->set_property("StartupTimeUs", uint64_t(total.count()));
+        LogMsg(Logger::Info, "[App]: Ready in ", total.count(), " us (",
+               mpsm.size(), " mount points)");
+    }
+
+    // Zero until the daemon is ready
+    void addStartupInterface()
+    {
+        startupIface = objServer->add_interface(
+            "/xyz/openbmc_project/VirtualMedia",
+            "xyz.openbmc_project.VirtualMedia.Startup");
+        startupIface->register_property("ConfigurationTimeUs", uint64_t(0));
+        startupIface->register_property("RegistrationTimeUs", uint64_t(0));
+        startupIface->register_property("ProvisioningTimeUs", uint64_t(0));
+        startupIface->register_property("StartupTimeUs", uint64_t(0));
+        startupIface->initialize();
+    }
+
+    void addLoggingInterface()
+    {
+        loggingIface = objServer->add_interface(
+            "/xyz/openbmc_project/VirtualMedia",
+            "xyz.openbmc_project.VirtualMedia.Logging");
+        loggingIface->register_property(
+            "Level", std::string(Logger::levelNames[Logger::level()]),
+            [](const std::string& req, std::string& property) {
+                const auto level = Logger::levelFromName(req);
+                if (!level)
+                {
+                    throw sdbusplus::exception::SdBusError(
+                        EINVAL, "Unknown log level");
+                }
+                Logger::setLevel(*level);
+                property = Logger::levelNames[Logger::level()];
+                return 1;
+            },
+            [](const std::string& property) {
+                return std::string(Logger::levelNames[Logger::level()]);
+            });
+        loggingIface->initialize();
+    }
+
+    void addTraceInterface()
+    {
+        traceIface = objServer->add_interface(
+            "/xyz/openbmc_project/VirtualMedia",
+            "xyz.openbmc_project.VirtualMedia.Trace");
+        // Chrome trace event format JSON, open in chrome://tracing or Perfetto
+        traceIface->register_method(
+            "Dump", []() { return TraceRing::instance().dumpChromeTrace(); });
+        traceIface->register_method("Clear",
+                                    []() { TraceRing::instance().clear(); });
+        traceIface->initialize();
+    }
+
+    // Joined first thing in destructor, see ~App
+    WorkerPool workers;
+#ifdef VM_IO_URING
+    std::unique_ptr<IoUring> ring;
+#endif
+    std::unique_ptr<nbd::SpillCache> spillCache;
+    std::unique_ptr<nbd::IoScheduler> ioScheduler;
+    SmbShareManager smbShares;
     boost::container::flat_map<std::string,
                                std::shared_ptr<MountPointStateMachine>>
         mpsm;
@@ -64,7 +253,14 @@ class App
     std::shared_ptr<sdbusplus::asio::connection> bus;
     std::shared_ptr<sdbusplus::asio::object_server> objServer;
     std::shared_ptr<sdbusplus::server::manager::manager> objManager;
+    std::shared_ptr<sdbusplus::asio::dbus_interface> loggingIface;
+    std::shared_ptr<sdbusplus::asio::dbus_interface> traceIface;
+    std::shared_ptr<sdbusplus::asio::dbus_interface> startupIface;
+    std::chrono::microseconds registrationTime{0};
+    std::chrono::microseconds provisioningTime{0};
     DeviceMonitor devMonitor;
+    VhubPortAllocator ports;
+    NBDDeviceAllocator nbdDevices;
     const Configuration& config;
 };
 
@@ -74,6 +270,9 @@ int main()
     if (!config.valid)
         return -1;
 
+    // Peer closing the socket during sendfile has to be reported as EPIPE
+    std::signal(SIGPIPE, SIG_IGN);
+
     boost::asio::io_context ioc;
     boost::asio::signal_set signals(ioc, SIGINT, SIGTERM);
     signals.async_wait(
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+
+namespace fs = std::filesystem;
+
+// Request latency distribution with power of 2 microsecond buckets, bucket N
+// counting requests which took less than 2^N us. Recording is just an
+// increment, percentiles are calculated only when published.
+struct LatencyHistogram
+{
+    static constexpr const size_t bucketCount = 32;
+
+    void record(std::chrono::steady_clock::duration latency)
+    {
+        const auto us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(latency)
+                .count());
+        buckets[std::min<size_t>(std::bit_width(us), bucketCount - 1)]++;
+        count++;
+        totalUs += us;
+    }
+
+    uint64_t averageUs() const
+    {
+        return count ? totalUs / count : 0;
+    }
+
+    // Upper bound (in microseconds) of bucket containing given percentile
+    uint64_t percentile(unsigned percent) const
+    {
+        if (count == 0)
+        {
+            return 0;
+        }
+        const uint64_t rank = (count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < bucketCount; bucket++)
+        {
+            seen += buckets[bucket];
+            if (seen >= rank)
+            {
+                return uint64_t(1) << bucket;
+            }
+        }
+        return uint64_t(1) << (bucketCount - 1);
+    }
+
+    std::array<uint64_t, bucketCount> buckets{};
+    uint64_t count = 0;
+    uint64_t totalUs = 0;
+};
+
+// I/O of single mount, updated on event loop thread only
+struct IoMetrics
+{
+    enum class Operation
+    {
+        read,
+        write,
+        flush
+    };
+
+    void record(Operation operation, uint64_t bytes, int error,
+                std::chrono::steady_clock::time_point start)
+    {
+        latency.record(std::chrono::steady_clock::now() - start);
+        if (error)
+        {
+            errors++;
+            return;
+        }
+        switch (operation)
+        {
+            case Operation::read:
+                readRequests++;
+                bytesRead += bytes;
+                break;
+            case Operation::write:
+                writeRequests++;
+                bytesWritten += bytes;
+                break;
+            case Operation::flush:
+                flushRequests++;
+                break;
+        }
+    }
+
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t readRequests = 0;
+    uint64_t writeRequests = 0;
+    uint64_t flushRequests = 0;
+    uint64_t errors = 0;
+    LatencyHistogram latency;
+};
+
+// Counters of block device (/sys/block/<dev>/stat), used when I/O is not
+// served from within the daemon. See Documentation/block/stat.rst.
+struct BlockDeviceStats
+{
+    static std::optional<BlockDeviceStats> read(const fs::path& sysfsPath)
+    {
+        std::ifstream file(sysfsPath / "stat");
+        BlockDeviceStats stats;
+        uint64_t readMerges, writeMerges;
+        file >> stats.readRequests >> readMerges >> stats.readSectors >>
+            stats.readTicksMs >> stats.writeRequests >> writeMerges >>
+            stats.writeSectors >> stats.writeTicksMs;
+        if (!file)
+        {
+            return {};
+        }
+        return stats;
+    }
+
+    BlockDeviceStats operator-(const BlockDeviceStats& rhs) const
+    {
+        return {readRequests - rhs.readRequests, readSectors - rhs.readSectors,
+                readTicksMs - rhs.readTicksMs, writeRequests - rhs.writeRequests,
+                writeSectors - rhs.writeSectors,
+                writeTicksMs - rhs.writeTicksMs};
+    }
+
+    uint64_t readRequests = 0;
+    uint64_t readSectors = 0;
+    uint64_t readTicksMs = 0;
+    uint64_t writeRequests = 0;
+    uint64_t writeSectors = 0;
+    uint64_t writeTicksMs = 0;
+};
@@ -0,0 +1,1158 @@
+#pragma once
+
+#include "io_uring.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "worker_pool.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/endian/conversion.hpp>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Minimal, in-process implementation of the server side of the NBD protocol
+// (fixed newstyle negotiation, simple replies). It serves a single export
+// over unix socket, so nbd-client can be pointed at it directly instead of
+// forking nbdkit for every mount. Protocol reference:
+// https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+namespace nbd
+{
+
+constexpr const uint64_t nbdMagic = 0x4e42444d41474943;      // "NBDMAGIC"
+constexpr const uint64_t optionMagic = 0x49484156454f5054;   // "IHAVEOPT"
+constexpr const uint64_t optionReplyMagic = 0x0003e889045565a9;
+constexpr const uint32_t requestMagic = 0x25609513;
+constexpr const uint32_t simpleReplyMagic = 0x67446698;
+
+// Handshake flags
+constexpr const uint16_t flagFixedNewstyle = 1 << 0;
+constexpr const uint16_t flagNoZeroes = 1 << 1;
+
+// Transmission flags
+constexpr const uint16_t flagHasFlags = 1 << 0;
+constexpr const uint16_t flagReadOnly = 1 << 1;
+constexpr const uint16_t flagSendFlush = 1 << 2;
+constexpr const uint16_t flagCanMultiConn = 1 << 8;
+
+// Information types used with NBD_OPT_INFO and NBD_OPT_GO
+constexpr const uint16_t infoExport = 0;
+constexpr const uint16_t infoBlockSize = 3;
+
+// Largest payload accepted in single request, matches nbd-server limit
+constexpr const uint32_t maxRequestSize = 32 * 1024 * 1024;
+// Largest option payload accepted during negotiation
+constexpr const uint32_t maxOptionSize = 4096;
+
+enum class Option : uint32_t
+{
+    exportName = 1,
+    abort = 2,
+    list = 3,
+    info = 6,
+    go = 7
+};
+
+enum class Reply : uint32_t
+{
+    ack = 1,
+    server = 2,
+    info = 3,
+    errUnsupported = (1u << 31) + 1,
+    errInvalid = (1u << 31) + 3,
+};
+
+enum class Command : uint16_t
+{
+    read = 0,
+    write = 1,
+    disconnect = 2,
+    flush = 3
+};
+
+// Big-endian (network order) serialization helpers
+template <typename T>
+static T load(const char* data)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return boost::endian::big_to_native(value);
+}
+
+template <typename T>
+static void append(std::vector<char>& buffer, T value)
+{
+    value = boost::endian::native_to_big(value);
+    const char* raw = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), raw, raw + sizeof(value));
+}
+
+using ReplyHeader = std::array<char, 16>;
+
+// Limits number of coroutines inside a section, others wait in FIFO order.
+// Slot released while someone waits is handed over directly to that waiter.
+class Semaphore
+{
+  public:
+    Semaphore(const boost::asio::any_io_executor& executor, unsigned count) :
+        executor(executor), count(count)
+    {}
+
+    void acquire(boost::asio::yield_context yield)
+    {
+        if (count > 0)
+        {
+            count--;
+            return;
+        }
+        auto timer = std::make_shared<boost::asio::steady_timer>(
+            executor, boost::asio::steady_timer::time_point::max());
+        waiters.push_back(timer);
+        boost::system::error_code ignored_ec;
+        timer->async_wait(yield[ignored_ec]);
+    }
+
+    void release()
+    {
+        if (waiters.empty())
+        {
+            count++;
+            return;
+        }
+        waiters.front()->cancel();
+        waiters.pop_front();
+    }
+
+  private:
+    boost::asio::any_io_executor executor;
+    unsigned count;
+    std::deque<std::shared_ptr<boost::asio::steady_timer>> waiters;
+};
+
+// Storage serving the export. All I/O functions return 0 on success or errno
+// value which is passed to the client as is.
+class Backend
+{
+  public:
+    virtual ~Backend() = default;
+
+    // Called once before first client is served, may suspend
+    virtual bool initialize(boost::asio::yield_context yield)
+    {
+        return true;
+    }
+
+    // Releases all resources, pending and further requests shall fail
+    virtual void close()
+    {}
+
+    virtual uint64_t size() const = 0;
+    virtual bool readOnly() const = 0;
+
+    virtual int read(uint64_t offset, char* data, size_t length,
+                     boost::asio::yield_context yield) = 0;
+
+    virtual int write(uint64_t offset, const char* data, size_t length,
+                      boost::asio::yield_context yield)
+    {
+        return EPERM;
+    }
+
+    virtual int flush(boost::asio::yield_context yield)
+    {
+        return 0;
+    }
+
+    // Number of reads backend is able to serve in parallel, session keeps up
+    // to that many client requests in flight
+    virtual unsigned concurrency() const
+    {
+        return 1;
+    }
+
+    // Backends able to move data from their own descriptor straight into the
+    // socket, without copying it through user space
+    virtual bool canSend() const
+    {
+        return false;
+    }
+
+    // Sends reply with given header followed by data. Returns 0 when reply
+    // is sent, errno when nothing was sent yet (error reply can follow) or
+    // negative errno when the stream is broken.
+    virtual int send(int socket, const ReplyHeader& header, uint64_t offset,
+                     size_t length, boost::asio::yield_context yield)
+    {
+        return ENOTSUP;
+    }
+};
+
+// Serves local image file (eg. one on mounted CIFS share). When worker pool
+// is given, I/O is done there so slow share does not stall the event loop.
+// With io_uring available (VM_IO_URING) kernel does the I/O asynchronously
+// instead of worker threads.
+class FileBackend : public Backend
+{
+  public:
+    FileBackend(const fs::path& file, bool rw,
+                std::optional<WorkerPool::Executor> workers = std::nullopt) :
+        file(file),
+        rw(rw), workers(std::move(workers))
+    {}
+
+    ~FileBackend()
+    {
+        close();
+    }
+
+    bool initialize(boost::asio::yield_context yield) override
+    {
+        fd = ::open(file.c_str(), (rw ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0)
+        {
+            LogMsg(Logger::Error, "[FileBackend]: Unable to open ", file,
+                   " errno = ", errno);
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            LogMsg(Logger::Error, "[FileBackend]: Unable to stat ", file,
+                   " errno = ", errno);
+            close();
+            return false;
+        }
+        fileSize = static_cast<uint64_t>(st.st_size);
+#ifdef VM_IO_URING
+        ring = IoUring::instance();
+#endif
+        LogMsg(Logger::Debug, "[FileBackend]: Serving ", file,
+               " size = ", fileSize);
+        return true;
+    }
+
+    void close() override
+    {
+        // Descriptor can't go away under operation running on worker thread
+        if (inFlight > 0)
+        {
+            closing = true;
+            return;
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    uint64_t size() const override
+    {
+        return fileSize;
+    }
+
+    bool readOnly() const override
+    {
+        return !rw;
+    }
+
+    int read(uint64_t offset, char* data, size_t length,
+             boost::asio::yield_context yield) override
+    {
+#ifdef VM_IO_URING
+        if (ring)
+        {
+            return track([&]() {
+                return ringTransfer(IORING_OP_READ, offset, data, length,
+                                    yield);
+            });
+        }
+#endif
+        return perform(yield, [fd = fd, offset, data, length]() {
+            return readAll(fd, offset, data, length);
+        });
+    }
+
+    int write(uint64_t offset, const char* data, size_t length,
+              boost::asio::yield_context yield) override
+    {
+#ifdef VM_IO_URING
+        if (ring)
+        {
+            return track([&]() {
+                return ringTransfer(IORING_OP_WRITE, offset,
+                                    const_cast<char*>(data), length, yield);
+            });
+        }
+#endif
+        return perform(yield, [fd = fd, offset, data, length]() {
+            return writeAll(fd, offset, data, length);
+        });
+    }
+
+    int flush(boost::asio::yield_context yield) override
+    {
+        return perform(yield, [fd = fd]() {
+            return (::fdatasync(fd) < 0) ? errno : 0;
+        });
+    }
+
+    bool canSend() const override
+    {
+        return true;
+    }
+
+    // Page cache (of CIFS mount) is spliced directly into the socket
+    int send(int socket, const ReplyHeader& header, uint64_t offset,
+             size_t length, boost::asio::yield_context yield) override
+    {
+#ifdef VM_IO_URING
+        if (ring && ring->hasFixedBuffers() &&
+            length <= IoUring::fixedBufferSize)
+        {
+            if (auto index = ring->acquireBuffer())
+            {
+                int ret = track([&]() {
+                    return ringSend(socket, header, offset, length, *index,
+                                    yield);
+                });
+                ring->releaseBuffer(*index);
+                return ret;
+            }
+        }
+#endif
+        return perform(yield, [fd = fd, socket, header, offset, length]() {
+            return sendAll(fd, socket, header, offset, length);
+        });
+    }
+
+  private:
+    // Descriptor can't be closed while operation using it is running
+    template <typename Function>
+    int track(Function&& function)
+    {
+        if (fd < 0 || closing)
+        {
+            return ESHUTDOWN;
+        }
+        inFlight++;
+        int ret = function();
+        inFlight--;
+        if (closing && inFlight == 0)
+        {
+            closing = false;
+            close();
+        }
+        return ret;
+    }
+
+    template <typename Function>
+    int perform(boost::asio::yield_context yield, Function&& function)
+    {
+        if (!workers)
+        {
+            return track(std::forward<Function>(function));
+        }
+        return track([&]() {
+            return runBlocking(*workers, std::forward<Function>(function),
+                               yield);
+        });
+    }
+
+#ifdef VM_IO_URING
+    int ringTransfer(uint8_t opcode, uint64_t offset, char* data,
+                     size_t length, boost::asio::yield_context yield)
+    {
+        while (length > 0)
+        {
+            auto [ret] = ring->run<1>(
+                {{{opcode, fd, data, static_cast<uint32_t>(length), offset}}},
+                yield);
+            if (ret == -EINTR || ret == -EAGAIN)
+            {
+                continue;
+            }
+            if (ret < 0)
+            {
+                return -ret;
+            }
+            if (ret == 0)
+            {
+                return EIO;
+            }
+            data += ret;
+            offset += ret;
+            length -= ret;
+        }
+        return 0;
+    }
+
+    // Read into registered buffer is linked with send of header and data,
+    // both go to kernel in single submission. Failed (or short) read cancels
+    // the send, so error reply can still be sent.
+    int ringSend(int socket, const ReplyHeader& header, uint64_t offset,
+                 size_t length, uint16_t index,
+                 boost::asio::yield_context yield)
+    {
+        char* data = ring->buffer(index);
+        std::array<iovec, 2> iov = {
+            {{const_cast<char*>(header.data()), header.size()},
+             {data, length}}};
+        msghdr message{};
+        message.msg_iov = iov.data();
+        message.msg_iovlen = iov.size();
+
+        auto [read, sent] = ring->run<2>(
+            {{{IORING_OP_READ_FIXED, fd, data, static_cast<uint32_t>(length),
+               offset, index},
+              {IORING_OP_SENDMSG, socket, &message, 1, 0, 0, MSG_NOSIGNAL}}},
+            yield);
+        if (read < 0)
+        {
+            return read == -EINTR || read == -EAGAIN ? EIO : -read;
+        }
+        if (static_cast<size_t>(read) < length)
+        {
+            int error = ringTransfer(IORING_OP_READ, offset + read, data + read,
+                                     length - read, yield);
+            if (error)
+            {
+                return error;
+            }
+            sent = 0;
+        }
+        else if (sent < 0)
+        {
+            return sent;
+        }
+
+        // Socket accepted only part of the reply
+        size_t done = static_cast<size_t>(sent);
+        while (done < header.size() + length)
+        {
+            const size_t headerDone = std::min(done, header.size());
+            iov[0].iov_base = const_cast<char*>(header.data()) + headerDone;
+            iov[0].iov_len = header.size() - headerDone;
+            iov[1].iov_base = data + (done - headerDone);
+            iov[1].iov_len = length - (done - headerDone);
+            auto [ret] = ring->run<1>(
+                {{{IORING_OP_SENDMSG, socket, &message, 1, 0, 0,
+                   MSG_NOSIGNAL}}},
+                yield);
+            if (ret <= 0)
+            {
+                return ret < 0 ? ret : -EIO;
+            }
+            done += static_cast<size_t>(ret);
+        }
+        return 0;
+    }
+#endif
+
+    static bool waitWritable(int socket)
+    {
+        pollfd pfd = {socket, POLLOUT, 0};
+        return ::poll(&pfd, 1, sendTimeoutMs) > 0;
+    }
+
+    // Socket is non-blocking, so when it is full this waits for it to drain.
+    // Once header is out errors are reported as negative.
+    static int sendAll(int fd, int socket, const ReplyHeader& header,
+                       uint64_t offset, size_t length)
+    {
+        size_t headerSent = 0;
+        while (headerSent < header.size())
+        {
+            ssize_t ret = ::send(socket, header.data() + headerSent,
+                                 header.size() - headerSent, MSG_NOSIGNAL);
+            if (ret < 0)
+            {
+                if (errno == EINTR || (errno == EAGAIN && waitWritable(socket)))
+                {
+                    continue;
+                }
+                return errno == EAGAIN ? -ETIMEDOUT : -errno;
+            }
+            headerSent += static_cast<size_t>(ret);
+        }
+
+        off_t position = static_cast<off_t>(offset);
+        while (length > 0)
+        {
+            ssize_t ret = ::sendfile(socket, fd, &position, length);
+            if (ret < 0)
+            {
+                if (errno == EINTR || (errno == EAGAIN && waitWritable(socket)))
+                {
+                    continue;
+                }
+                return errno == EAGAIN ? -ETIMEDOUT : -errno;
+            }
+            if (ret == 0)
+            {
+                return -EIO;
+            }
+            length -= static_cast<size_t>(ret);
+        }
+        return 0;
+    }
+
+    static int readAll(int fd, uint64_t offset, char* data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t ret = ::pread(fd, data, length, offset);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return errno;
+            }
+            if (ret == 0)
+            {
+                return EIO;
+            }
+            data += ret;
+            offset += ret;
+            length -= ret;
+        }
+        return 0;
+    }
+
+    static int writeAll(int fd, uint64_t offset, const char* data,
+                        size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t ret = ::pwrite(fd, data, length, offset);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return errno;
+            }
+            data += ret;
+            offset += ret;
+            length -= ret;
+        }
+        return 0;
+    }
+
+    // nbd-client not reading for this long is considered dead
+    static constexpr const int sendTimeoutMs = 30 * 1000;
+
+    fs::path file;
+    bool rw;
+    std::optional<WorkerPool::Executor> workers;
+#ifdef VM_IO_URING
+    IoUring* ring = nullptr;
+#endif
+    int fd = -1;
+    uint64_t fileSize = 0;
+    unsigned inFlight = 0;
+    bool closing = false;
+};
+
+class Session : public std::enable_shared_from_this<Session>
+{
+  public:
+    using Socket = boost::asio::local::stream_protocol::socket;
+
+    Session(Socket&& socket, std::shared_ptr<Backend> backend,
+            const std::string& name, IoMetrics& metrics) :
+        socket(std::move(socket)),
+        backend(backend), name(name), metrics(metrics),
+        requests(this->socket.get_executor(), backend->concurrency()),
+        replies(this->socket.get_executor(), 1)
+    {}
+
+    void run(boost::asio::yield_context yield)
+    {
+        LogMsg(Logger::Debug, "[Session]: (", name, ") Client connected");
+        if (negotiate(yield))
+        {
+            transmission(yield);
+        }
+        close();
+        LogMsg(Logger::Debug, "[Session]: (", name, ") Client disconnected");
+    }
+
+    void close()
+    {
+        boost::system::error_code ignored_ec;
+        socket.shutdown(Socket::shutdown_both, ignored_ec);
+        socket.close(ignored_ec);
+    }
+
+  private:
+    uint16_t transmissionFlags() const
+    {
+        uint16_t flags = flagHasFlags | flagSendFlush | flagCanMultiConn;
+        if (backend->readOnly())
+        {
+            flags |= flagReadOnly;
+        }
+        return flags;
+    }
+
+    bool sendOptionReply(uint32_t option, Reply reply,
+                         const std::vector<char>& payload,
+                         boost::asio::yield_context yield)
+    {
+        std::vector<char> header;
+        append<uint64_t>(header, optionReplyMagic);
+        append<uint32_t>(header, option);
+        append<uint32_t>(header, static_cast<uint32_t>(reply));
+        append<uint32_t>(header, static_cast<uint32_t>(payload.size()));
+
+        boost::system::error_code ec;
+        std::array<boost::asio::const_buffer, 2> buffers = {
+            boost::asio::buffer(header), boost::asio::buffer(payload)};
+        boost::asio::async_write(socket, buffers, yield[ec]);
+        return !ec;
+    }
+
+    bool negotiate(boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+
+        std::vector<char> greeting;
+        append<uint64_t>(greeting, nbdMagic);
+        append<uint64_t>(greeting, optionMagic);
+        append<uint16_t>(greeting, flagFixedNewstyle | flagNoZeroes);
+        boost::asio::async_write(socket, boost::asio::buffer(greeting),
+                                 yield[ec]);
+        if (ec)
+        {
+            return false;
+        }
+
+        std::array<char, 4> clientFlagsRaw;
+        boost::asio::async_read(socket, boost::asio::buffer(clientFlagsRaw),
+                                yield[ec]);
+        if (ec)
+        {
+            return false;
+        }
+        const bool noZeroes =
+            load<uint32_t>(clientFlagsRaw.data()) & flagNoZeroes;
+
+        while (1)
+        {
+            std::array<char, 16> header;
+            boost::asio::async_read(socket, boost::asio::buffer(header),
+                                    yield[ec]);
+            if (ec)
+            {
+                return false;
+            }
+            if (load<uint64_t>(header.data()) != optionMagic)
+            {
+                LogMsg(Logger::Error, "[Session]: (", name,
+                       ") Bad option magic");
+                return false;
+            }
+            const uint32_t option = load<uint32_t>(header.data() + 8);
+            const uint32_t length = load<uint32_t>(header.data() + 12);
+            if (length > maxOptionSize)
+            {
+                LogMsg(Logger::Error, "[Session]: (", name,
+                       ") Option too long: ", length);
+                return false;
+            }
+
+            std::vector<char> data(length);
+            boost::asio::async_read(socket, boost::asio::buffer(data),
+                                    yield[ec]);
+            if (ec)
+            {
+                return false;
+            }
+
+            LogMsg(Logger::Debug, "[Session]: (", name, ") Option ", option);
+            switch (static_cast<Option>(option))
+            {
+                case Option::exportName:
+                {
+                    std::vector<char> reply;
+                    append<uint64_t>(reply, backend->size());
+                    append<uint16_t>(reply, transmissionFlags());
+                    if (!noZeroes)
+                    {
+                        reply.resize(reply.size() + 124, 0);
+                    }
+                    boost::asio::async_write(socket, boost::asio::buffer(reply),
+                                             yield[ec]);
+                    return !ec;
+                }
+                case Option::abort:
+                    sendOptionReply(option, Reply::ack, {}, yield);
+                    return false;
+                case Option::list:
+                {
+                    // Single, unnamed export
+                    std::vector<char> payload;
+                    append<uint32_t>(payload, 0);
+                    if (!sendOptionReply(option, Reply::server, payload,
+                                         yield) ||
+                        !sendOptionReply(option, Reply::ack, {}, yield))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                case Option::info:
+                case Option::go:
+                {
+                    bool blockSizeRequested = false;
+                    if (!parseInfoRequest(data, blockSizeRequested))
+                    {
+                        if (!sendOptionReply(option, Reply::errInvalid, {},
+                                             yield))
+                        {
+                            return false;
+                        }
+                        break;
+                    }
+
+                    std::vector<char> info;
+                    append<uint16_t>(info, infoExport);
+                    append<uint64_t>(info, backend->size());
+                    append<uint16_t>(info, transmissionFlags());
+                    if (!sendOptionReply(option, Reply::info, info, yield))
+                    {
+                        return false;
+                    }
+                    if (blockSizeRequested)
+                    {
+                        std::vector<char> blockSize;
+                        append<uint16_t>(blockSize, infoBlockSize);
+                        append<uint32_t>(blockSize, 1);
+                        append<uint32_t>(blockSize, 4096);
+                        append<uint32_t>(blockSize, maxRequestSize);
+                        if (!sendOptionReply(option, Reply::info, blockSize,
+                                             yield))
+                        {
+                            return false;
+                        }
+                    }
+                    if (!sendOptionReply(option, Reply::ack, {}, yield))
+                    {
+                        return false;
+                    }
+                    if (static_cast<Option>(option) == Option::go)
+                    {
+                        return true;
+                    }
+                    break;
+                }
+                default:
+                    if (!sendOptionReply(option, Reply::errUnsupported, {},
+                                         yield))
+                    {
+                        return false;
+                    }
+                    break;
+            }
+        }
+    }
+
+    // Validates NBD_OPT_INFO/NBD_OPT_GO payload: name length, name, number of
+    // information requests and the requests themselves
+    static bool parseInfoRequest(const std::vector<char>& data,
+                                 bool& blockSizeRequested)
+    {
+        if (data.size() < 6)
+        {
+            return false;
+        }
+        const uint32_t nameLength = load<uint32_t>(data.data());
+        if (data.size() < 6 + static_cast<size_t>(nameLength))
+        {
+            return false;
+        }
+        const uint16_t count = load<uint16_t>(data.data() + 4 + nameLength);
+        if (data.size() != 6 + nameLength + 2 * static_cast<size_t>(count))
+        {
+            return false;
+        }
+        for (uint16_t i = 0; i < count; i++)
+        {
+            if (load<uint16_t>(data.data() + 6 + nameLength + 2 * i) ==
+                infoBlockSize)
+            {
+                blockSizeRequested = true;
+            }
+        }
+        return true;
+    }
+
+    static ReplyHeader replyHeader(uint64_t handle, int error)
+    {
+        ReplyHeader header;
+        uint32_t magic = boost::endian::native_to_big(simpleReplyMagic);
+        uint32_t err = boost::endian::native_to_big(static_cast<uint32_t>(error));
+        std::memcpy(header.data(), &magic, 4);
+        std::memcpy(header.data() + 4, &err, 4);
+        std::memcpy(header.data() + 8, &handle, 8); // opaque, sent back as is
+        return header;
+    }
+
+    bool sendReply(uint64_t handle, int error, const char* data,
+                   size_t length, boost::asio::yield_context yield)
+    {
+        const ReplyHeader header = replyHeader(handle, error);
+        std::array<boost::asio::const_buffer, 2> buffers = {
+            boost::asio::buffer(header),
+            boost::asio::buffer(data, error ? 0 : length)};
+        boost::system::error_code ec;
+        // Replies of parallel reads must not interleave
+        replies.acquire(yield);
+        boost::asio::async_write(socket, buffers, yield[ec]);
+        replies.release();
+        return !ec;
+    }
+
+    // Read is served in its own coroutine, reply is sent whenever it is done
+    // (replies carry handle, so order does not matter to the client)
+    void readInParallel(uint64_t handle, uint64_t offset, uint32_t length,
+                        boost::asio::yield_context yield)
+    {
+        requests.acquire(yield);
+        boost::asio::spawn(
+            socket.get_executor(),
+            [this, self = shared_from_this(), handle, offset,
+             length](boost::asio::yield_context yield) {
+                std::vector<char> buffer(length);
+                const auto start = std::chrono::steady_clock::now();
+                int error = backend->read(offset, buffer.data(), length, yield);
+                metrics.record(IoMetrics::Operation::read, length, error,
+                               start);
+                if (!sendReply(handle, error, buffer.data(), length, yield))
+                {
+                    close();
+                }
+                requests.release();
+            });
+    }
+
+    // Waits until all parallel reads are done
+    void drain(boost::asio::yield_context yield)
+    {
+        const unsigned slots = backend->concurrency();
+        for (unsigned slot = 0; slot < slots; slot++)
+        {
+            requests.acquire(yield);
+        }
+        for (unsigned slot = 0; slot < slots; slot++)
+        {
+            requests.release();
+        }
+    }
+
+    // Simple reply carries no error once header is sent, so failure after
+    // that point can only be signalled by dropping the connection
+    bool sendZeroCopy(uint64_t handle, uint64_t offset, uint32_t length,
+                      boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+        socket.native_non_blocking(true, ec);
+        if (ec)
+        {
+            return false;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const int ret = backend->send(socket.native_handle(),
+                                      replyHeader(handle, 0), offset, length,
+                                      yield);
+        metrics.record(IoMetrics::Operation::read, length, ret < 0 ? -ret : ret,
+                       start);
+        if (ret < 0)
+        {
+            LogMsg(Logger::Error, "[Session]: (", name,
+                   ") Zero-copy read failed, errno = ", -ret);
+            return false;
+        }
+        if (ret > 0)
+        {
+            return sendReply(handle, ret, nullptr, 0, yield);
+        }
+        return true;
+    }
+
+    void transmission(boost::asio::yield_context yield)
+    {
+        boost::system::error_code ec;
+        std::array<char, 28> header;
+        std::vector<char> buffer;
+
+        while (1)
+        {
+            boost::asio::async_read(socket, boost::asio::buffer(header),
+                                    yield[ec]);
+            if (ec)
+            {
+                if (ec != boost::asio::error::eof &&
+                    ec != boost::asio::error::operation_aborted)
+                {
+                    LogMsg(Logger::Error, "[Session]: (", name,
+                           ") Read error: ", ec);
+                }
+                return;
+            }
+
+            if (load<uint32_t>(header.data()) != requestMagic)
+            {
+                LogMsg(Logger::Error, "[Session]: (", name,
+                       ") Bad request magic");
+                return;
+            }
+            const auto command =
+                static_cast<Command>(load<uint16_t>(header.data() + 6));
+            uint64_t handle;
+            std::memcpy(&handle, header.data() + 8, 8);
+            const uint64_t offset = load<uint64_t>(header.data() + 16);
+            const uint32_t length = load<uint32_t>(header.data() + 24);
+
+            const bool inRange = offset <= backend->size() &&
+                                 length <= backend->size() - offset;
+
+            int error = 0;
+            std::chrono::steady_clock::time_point start;
+            // Anything but read sees effects of all reads before it
+            if (command != Command::read)
+            {
+                drain(yield);
+            }
+            switch (command)
+            {
+                case Command::read:
+                    if (length > maxRequestSize)
+                    {
+                        LogMsg(Logger::Error, "[Session]: (", name,
+                               ") Request too big: ", length);
+                        return;
+                    }
+                    if (!inRange)
+                    {
+                        error = EINVAL;
+                        break;
+                    }
+                    if (backend->canSend())
+                    {
+                        if (!sendZeroCopy(handle, offset, length, yield))
+                        {
+                            return;
+                        }
+                        continue;
+                    }
+                    if (backend->concurrency() > 1)
+                    {
+                        readInParallel(handle, offset, length, yield);
+                        continue;
+                    }
+                    buffer.resize(length);
+                    start = std::chrono::steady_clock::now();
+                    error = backend->read(offset, buffer.data(), length, yield);
+                    metrics.record(IoMetrics::Operation::read, length, error,
+                                   start);
+                    if (!sendReply(handle, error, buffer.data(), length, yield))
+                    {
+                        return;
+                    }
+                    continue;
+                case Command::write:
+                    if (length > maxRequestSize)
+                    {
+                        LogMsg(Logger::Error, "[Session]: (", name,
+                               ") Request too big: ", length);
+                        return;
+                    }
+                    buffer.resize(length);
+                    boost::asio::async_read(socket, boost::asio::buffer(buffer),
+                                            yield[ec]);
+                    if (ec)
+                    {
+                        return;
+                    }
+                    if (backend->readOnly())
+                    {
+                        error = EPERM;
+                    }
+                    else if (!inRange)
+                    {
+                        error = ENOSPC;
+                    }
+                    else
+                    {
+                        start = std::chrono::steady_clock::now();
+                        error = backend->write(offset, buffer.data(), length,
+                                               yield);
+                        metrics.record(IoMetrics::Operation::write, length,
+                                       error, start);
+                    }
+                    break;
+                case Command::flush:
+                    start = std::chrono::steady_clock::now();
+                    error = backend->flush(yield);
+                    metrics.record(IoMetrics::Operation::flush, 0, error, start);
+                    break;
+                case Command::disconnect:
+                    LogMsg(Logger::Debug, "[Session]: (", name,
+                           ") Disconnect requested");
+                    return;
+                default:
+                    error = EINVAL;
+                    break;
+            }
+
+            if (!sendReply(handle, error, nullptr, 0, yield))
+            {
+                return;
+            }
+        }
+    }
+
+    Socket socket;
+    std::shared_ptr<Backend> backend;
+    std::string name;
+    IoMetrics& metrics;
+    Semaphore requests;
+    Semaphore replies;
+};
+
+class Server : public std::enable_shared_from_this<Server>
+{
+  public:
+    Server(boost::asio::io_context& ioc, const std::string& name,
+           std::shared_ptr<Backend> backend, IoMetrics& metrics) :
+        ioc(ioc),
+        acceptor(ioc), name(name), backend(backend), metrics(metrics)
+    {}
+
+    Server(const Server&) = delete;
+    Server(Server&&) = delete;
+
+    Server& operator=(const Server&) = delete;
+    Server& operator=(Server&&) = delete;
+
+    // Binds to socket synchronously, so client can be started right after
+    // this call returns. Backend is initialized before first client is
+    // accepted.
+    bool start(const fs::path& unixSocket)
+    {
+        boost::system::error_code ec;
+        acceptor.open(boost::asio::local::stream_protocol(), ec);
+        if (!ec)
+        {
+            acceptor.bind(unixSocket.string(), ec);
+        }
+        if (!ec)
+        {
+            acceptor.listen(boost::asio::socket_base::max_listen_connections,
+                            ec);
+        }
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[Server]: (", name,
+                   ") Unable to listen on ", unixSocket, ": ", ec);
+            return false;
+        }
+        socketPath = unixSocket;
+
+        boost::asio::spawn(ioc, [this, self = shared_from_this()](
+                                    boost::asio::yield_context yield) {
+            if (!backend->initialize(yield))
+            {
+                LogMsg(Logger::Error, "[Server]: (", name,
+                       ") Backend initialization failed");
+                stop();
+                return;
+            }
+
+            while (acceptor.is_open())
+            {
+                boost::system::error_code ec;
+                Session::Socket socket(ioc);
+                acceptor.async_accept(socket, yield[ec]);
+                if (ec)
+                {
+                    if (ec != boost::asio::error::operation_aborted)
+                    {
+                        LogMsg(Logger::Error, "[Server]: (", name,
+                               ") Accept failed: ", ec);
+                    }
+                    break;
+                }
+
+                auto session = std::make_shared<Session>(
+                    std::move(socket), backend, name, metrics);
+                sessions.remove_if(
+                    [](const auto& session) { return session.expired(); });
+                sessions.push_back(session);
+                boost::asio::spawn(ioc,
+                                   [session](boost::asio::yield_context yield) {
+                                       session->run(yield);
+                                   });
+            }
+            LogMsg(Logger::Debug, "[Server]: (", name, ") Stopped accepting");
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        acceptor.close(ignored_ec);
+        for (auto& weakSession : sessions)
+        {
+            if (auto session = weakSession.lock())
+            {
+                session->close();
+            }
+        }
+        sessions.clear();
+        backend->close();
+
+        if (!socketPath.empty())
+        {
+            std::error_code ec;
+            fs::remove(socketPath, ec);
+            socketPath.clear();
+        }
+    }
+
+  private:
+    boost::asio::io_context& ioc;
+    boost::asio::local::stream_protocol::acceptor acceptor;
+    std::string name;
+    std::shared_ptr<Backend> backend;
+    IoMetrics& metrics;
+    std::list<std::weak_ptr<Session>> sessions;
+    fs::path socketPath;
+};
+
+} // namespace nbd
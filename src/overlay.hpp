@@ -0,0 +1,270 @@
+#pragma once
+
+#include "logger.hpp"
+#include "nbd_server.hpp"
+#include "worker_pool.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nbd
+{
+
+// Makes read-only image writable without touching it. Written blocks land in
+// sparse delta file, bitmap tells which blocks are read from there instead of
+// inner backend. Delta file is unlinked right after it is created, so it is
+// gone with the mount (or crashed daemon) and only its data occupies space.
+class OverlayBackend : public Backend
+{
+  public:
+    static constexpr const uint64_t blockSize = 4096;
+
+    OverlayBackend(boost::asio::io_context& ioc, std::shared_ptr<Backend> inner,
+                   const fs::path& directory, const std::string& name,
+                   WorkerPool::Executor workers) :
+        ioc(ioc),
+        inner(std::move(inner)), directory(directory), name(name),
+        workers(std::move(workers))
+    {}
+
+    ~OverlayBackend()
+    {
+        close();
+    }
+
+    bool initialize(boost::asio::yield_context yield) override
+    {
+        if (!inner->initialize(yield))
+        {
+            return false;
+        }
+
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        const fs::path path = directory / (name + ".overlay");
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(inner->size())) < 0)
+        {
+            LogMsg(Logger::Error, "[OverlayBackend]: Unable to create ", path,
+                   " errno = ", errno);
+            close();
+            return false;
+        }
+        fs::remove(path, ec);
+        written.assign((inner->size() + blockSize - 1) / blockSize, false);
+        LogMsg(Logger::Debug, "[OverlayBackend]: Writes go to ", directory);
+        return true;
+    }
+
+    void close() override
+    {
+        inner->close();
+        // Descriptor can't go away under operation running on worker thread
+        if (inFlight > 0)
+        {
+            closing = true;
+            return;
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    uint64_t size() const override
+    {
+        return inner->size();
+    }
+
+    bool readOnly() const override
+    {
+        return false;
+    }
+
+    unsigned concurrency() const override
+    {
+        return inner->concurrency();
+    }
+
+    // Runs of blocks are read from wherever their current content is
+    int read(uint64_t offset, char* data, size_t length,
+             boost::asio::yield_context yield) override
+    {
+        const uint64_t end = offset + length;
+        uint64_t position = offset;
+        while (position < end)
+        {
+            const bool local = written[position / blockSize];
+            uint64_t runEnd = (position / blockSize + 1) * blockSize;
+            while (runEnd < end && written[runEnd / blockSize] == local)
+            {
+                runEnd += blockSize;
+            }
+            runEnd = std::min(runEnd, end);
+
+            char* target = data + (position - offset);
+            const size_t runLength = runEnd - position;
+            int error = local ? transfer(false, position, target, runLength,
+                                         yield)
+                              : inner->read(position, target, runLength, yield);
+            if (error)
+            {
+                return error;
+            }
+            position = runEnd;
+        }
+        return 0;
+    }
+
+    // Whole blocks are written, partially covered edge blocks are completed
+    // with their current content first. Writes sharing a block run one after
+    // another (sessions of all connections share the backend), concurrent
+    // read-modify-write would lose one of them.
+    int write(uint64_t offset, const char* data, size_t length,
+              boost::asio::yield_context yield) override
+    {
+        if (length == 0)
+        {
+            return 0;
+        }
+        const uint64_t first = offset / blockSize;
+        const uint64_t last = (offset + length - 1) / blockSize;
+        lockBlocks(first, last, yield);
+        int error = writeBlocks(first, last, offset, data, length, yield);
+        unlockBlocks(first, last);
+        return error;
+    }
+
+    // Delta does not outlive the mount, there is nothing to make durable
+    int flush(boost::asio::yield_context yield) override
+    {
+        return 0;
+    }
+
+  private:
+    int writeBlocks(uint64_t first, uint64_t last, uint64_t offset,
+                    const char* data, size_t length,
+                    boost::asio::yield_context yield)
+    {
+        const uint64_t begin = first * blockSize;
+        const uint64_t end = std::min((last + 1) * blockSize, size());
+        std::vector<char> buffer(end - begin);
+
+        const bool headPartial = offset > begin;
+        const bool tailPartial = offset + length < end;
+        if (headPartial || (tailPartial && first == last))
+        {
+            int error = read(begin, buffer.data(),
+                             std::min(blockSize, end - begin), yield);
+            if (error)
+            {
+                return error;
+            }
+        }
+        if (tailPartial && last != first)
+        {
+            const uint64_t lastBegin = last * blockSize;
+            int error = read(lastBegin, buffer.data() + (lastBegin - begin),
+                             end - lastBegin, yield);
+            if (error)
+            {
+                return error;
+            }
+        }
+        std::copy(data, data + length, buffer.begin() + (offset - begin));
+
+        int error = transfer(true, begin, buffer.data(), buffer.size(), yield);
+        if (error)
+        {
+            return error;
+        }
+        std::fill(written.begin() + static_cast<ptrdiff_t>(first),
+                  written.begin() + static_cast<ptrdiff_t>(last + 1), true);
+        return 0;
+    }
+
+    void lockBlocks(uint64_t first, uint64_t last,
+                    boost::asio::yield_context yield)
+    {
+        while (true)
+        {
+            const auto it = locked.lower_bound(first);
+            if (it == locked.end() || it->first > last)
+            {
+                break;
+            }
+            auto done = it->second;
+            boost::system::error_code ignored_ec;
+            done->async_wait(yield[ignored_ec]);
+        }
+        auto done = std::make_shared<boost::asio::steady_timer>(
+            ioc, boost::asio::steady_timer::time_point::max());
+        for (uint64_t index = first; index <= last; index++)
+        {
+            locked[index] = done;
+        }
+    }
+
+    void unlockBlocks(uint64_t first, uint64_t last)
+    {
+        const auto it = locked.find(first);
+        auto done = it->second;
+        locked.erase(it, locked.upper_bound(last));
+        done->cancel();
+    }
+
+    int transfer(bool write, uint64_t offset, char* data, size_t length,
+                 boost::asio::yield_context yield)
+    {
+        if (fd < 0 || closing)
+        {
+            return ESHUTDOWN;
+        }
+        inFlight++;
+        int ret = runBlocking(
+            workers,
+            [fd = fd, write, offset, data, length]() {
+                const ssize_t ret =
+                    write ? ::pwrite(fd, data, length, static_cast<off_t>(offset))
+                          : ::pread(fd, data, length, static_cast<off_t>(offset));
+                if (ret < 0)
+                {
+                    return errno;
+                }
+                return ret == static_cast<ssize_t>(length) ? 0 : EIO;
+            },
+            yield);
+        inFlight--;
+        if (closing && inFlight == 0)
+        {
+            closing = false;
+            close();
+        }
+        return ret;
+    }
+
+    boost::asio::io_context& ioc;
+    std::shared_ptr<Backend> inner;
+    fs::path directory;
+    std::string name;
+    WorkerPool::Executor workers;
+    int fd = -1;
+    unsigned inFlight = 0;
+    bool closing = false;
+    std::vector<bool> written;
+    // Blocks being written, timer is cancelled once write is done
+    std::map<uint64_t, std::shared_ptr<boost::asio::steady_timer>> locked;
+};
+
+} // namespace nbd
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "logger.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Sits between nbd-client and Proxy mode socket of bmcweb. Kernel writes
+// every NBD request separately and bmcweb wraps whatever single read returns
+// into WebSocket frame, so requests travelling towards the browser are
+// coalesced into batches of up to flushBytes. Batch is sent as soon as no
+// more data is pending, optionally after waiting flushDelay for more.
+// Direction towards the client is relayed as is.
+class ProxyRelay : public std::enable_shared_from_this<ProxyRelay>
+{
+  public:
+    using Socket = boost::asio::local::stream_protocol::socket;
+
+    ProxyRelay(boost::asio::io_context& ioc, const std::string& name,
+               const fs::path& upstream, size_t flushBytes,
+               std::chrono::microseconds flushDelay) :
+        ioc(ioc),
+        acceptor(ioc), name(name), upstream(upstream), flushBytes(flushBytes),
+        flushDelay(flushDelay)
+    {}
+
+    ProxyRelay(const ProxyRelay&) = delete;
+    ProxyRelay& operator=(const ProxyRelay&) = delete;
+
+    // Binds synchronously, so nbd-client can be started right after this
+    // call returns. Upstream is connected for every accepted client.
+    bool start(const fs::path& unixSocket)
+    {
+        boost::system::error_code ec;
+        std::error_code removeEc;
+        fs::remove(unixSocket, removeEc);
+        acceptor.open(boost::asio::local::stream_protocol(), ec);
+        if (!ec)
+        {
+            acceptor.bind(unixSocket.string(), ec);
+        }
+        if (!ec)
+        {
+            acceptor.listen(boost::asio::socket_base::max_listen_connections,
+                            ec);
+        }
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[ProxyRelay]: (", name,
+                   ") Unable to listen on ", unixSocket, ": ", ec);
+            return false;
+        }
+        socketPath = unixSocket;
+
+        boost::asio::spawn(ioc, [this, self = shared_from_this()](
+                                    boost::asio::yield_context yield) {
+            while (acceptor.is_open())
+            {
+                boost::system::error_code ec;
+                auto client = std::make_shared<Socket>(ioc);
+                acceptor.async_accept(*client, yield[ec]);
+                if (ec)
+                {
+                    if (ec != boost::asio::error::operation_aborted)
+                    {
+                        LogMsg(Logger::Error, "[ProxyRelay]: (", name,
+                               ") Accept failed: ", ec);
+                    }
+                    break;
+                }
+
+                auto proxy = std::make_shared<Socket>(ioc);
+                proxy->async_connect(
+                    boost::asio::local::stream_protocol::endpoint(
+                        upstream.string()),
+                    yield[ec]);
+                if (ec)
+                {
+                    LogMsg(Logger::Error, "[ProxyRelay]: (", name,
+                           ") Unable to connect to ", upstream, ": ", ec);
+                    continue;
+                }
+                LogMsg(Logger::Debug, "[ProxyRelay]: (", name,
+                       ") Relaying to ", upstream);
+
+                sockets.remove_if(
+                    [](const auto& socket) { return socket.expired(); });
+                sockets.push_back(client);
+                sockets.push_back(proxy);
+                relay(client, proxy, true);
+                relay(proxy, client, false);
+            }
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        acceptor.close(ignored_ec);
+        for (auto& weakSocket : sockets)
+        {
+            if (auto socket = weakSocket.lock())
+            {
+                socket->close(ignored_ec);
+            }
+        }
+        sockets.clear();
+
+        if (!socketPath.empty())
+        {
+            std::error_code ec;
+            fs::remove(socketPath, ec);
+            socketPath.clear();
+        }
+    }
+
+    // Largest batch written towards the proxy at once
+    size_t transferSize() const
+    {
+        return flushBytes;
+    }
+
+  private:
+    static constexpr const size_t minBufferSize = 128 * 1024;
+
+    // Either direction ending closes both, nbd-client then sees the
+    // connection drop just like without relay
+    void relay(std::shared_ptr<Socket> from, std::shared_ptr<Socket> to,
+               bool batched)
+    {
+        boost::asio::spawn(ioc, [this, self = shared_from_this(), from, to,
+                                 batched](boost::asio::yield_context yield) {
+            // Replies to reads are large, batch size must not limit them
+            std::vector<char> buffer(
+                batched ? flushBytes : std::max(flushBytes, minBufferSize));
+            boost::asio::steady_timer timer(ioc);
+            boost::system::error_code ec;
+            from->non_blocking(true, ec);
+
+            while (!ec)
+            {
+                size_t used =
+                    from->async_read_some(boost::asio::buffer(buffer),
+                                          yield[ec]);
+                if (ec)
+                {
+                    break;
+                }
+                if (batched && flushDelay.count() && used < buffer.size())
+                {
+                    timer.expires_after(flushDelay);
+                    boost::system::error_code ignored_ec;
+                    timer.async_wait(yield[ignored_ec]);
+                }
+                // Whatever arrived meanwhile goes out with the same write
+                while (batched && used < buffer.size())
+                {
+                    boost::system::error_code readEc;
+                    const size_t more = from->read_some(
+                        boost::asio::buffer(buffer.data() + used,
+                                            buffer.size() - used),
+                        readEc);
+                    if (readEc)
+                    {
+                        break;
+                    }
+                    used += more;
+                }
+                boost::asio::async_write(
+                    *to, boost::asio::buffer(buffer.data(), used), yield[ec]);
+            }
+
+            if (ec != boost::asio::error::eof &&
+                ec != boost::asio::error::operation_aborted &&
+                ec != boost::asio::error::bad_descriptor)
+            {
+                LogMsg(Logger::Debug, "[ProxyRelay]: (", name,
+                       ") Relay ended: ", ec);
+            }
+            boost::system::error_code ignored_ec;
+            from->close(ignored_ec);
+            to->close(ignored_ec);
+        });
+    }
+
+    boost::asio::io_context& ioc;
+    boost::asio::local::stream_protocol::acceptor acceptor;
+    std::string name;
+    fs::path upstream;
+    size_t flushBytes;
+    std::chrono::microseconds flushDelay;
+    std::list<std::weak_ptr<Socket>> sockets;
+    fs::path socketPath;
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "logger.hpp"
+
+#include <signal.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Active sessions survive daemon restart: nbdkit and nbd-client processes,
+// connected NBD devices, CIFS mounts and bound USB gadgets are left running
+// and journal file of every slot tells restarted daemon what to adopt. Only
+// sessions not served by the daemon itself (built-in NBD server, proxy relay)
+// can be journaled. Journal is disabled when directory is not set.
+class SessionJournal
+{
+  public:
+    struct Entry
+    {
+        pid_t pid = 0;
+        std::string application;
+        std::string device;
+        std::string imageUrl;
+        bool rw = false;
+        std::string user;
+        std::optional<fs::path> mountDir;
+    };
+
+    static void setDirectory(const fs::path& path)
+    {
+        directory = path;
+    }
+
+    static bool enabled()
+    {
+        return !directory.empty();
+    }
+
+    // Written to temporary file first, restart never sees partial entry
+    static void store(const std::string& slot, const Entry& entry)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        nlohmann::json json = {{"Pid", entry.pid},
+                               {"Application", entry.application},
+                               {"Device", entry.device},
+                               {"ImageURL", entry.imageUrl},
+                               {"RW", entry.rw},
+                               {"User", entry.user}};
+        if (entry.mountDir)
+        {
+            json["MountDir"] = entry.mountDir->string();
+        }
+
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        const fs::path path = entryPath(slot);
+        const fs::path temporary = path.string() + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::trunc);
+            file << json.dump();
+            if (!file)
+            {
+                LogMsg(Logger::Error, "[SessionJournal]: Unable to write ",
+                       temporary);
+                return;
+            }
+        }
+        fs::rename(temporary, path, ec);
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[SessionJournal]: Unable to write ", path,
+                   ": ", ec);
+        }
+    }
+
+    static std::optional<Entry> load(const std::string& slot)
+    {
+        if (!enabled())
+        {
+            return {};
+        }
+        std::ifstream file(entryPath(slot));
+        if (!file.is_open())
+        {
+            return {};
+        }
+        try
+        {
+            const auto json = nlohmann::json::parse(file);
+            Entry entry;
+            entry.pid = json.at("Pid").get<pid_t>();
+            entry.application = json.at("Application").get<std::string>();
+            entry.device = json.at("Device").get<std::string>();
+            entry.imageUrl = json.at("ImageURL").get<std::string>();
+            entry.rw = json.at("RW").get<bool>();
+            entry.user = json.at("User").get<std::string>();
+            const auto mountDir = json.find("MountDir");
+            if (mountDir != json.end())
+            {
+                entry.mountDir = mountDir->get<std::string>();
+            }
+            return entry;
+        }
+        catch (const std::exception& e)
+        {
+            LogMsg(Logger::Error, "[SessionJournal]: Invalid entry of ", slot);
+            remove(slot);
+            return {};
+        }
+    }
+
+    static void remove(const std::string& slot)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        std::error_code ec;
+        fs::remove(entryPath(slot), ec);
+    }
+
+    // Service keeps children running when the daemon stops (KillMode=process),
+    // only journaled ones are adopted though. Everything else still in the
+    // daemon's cgroup is left over from previous instance and would keep
+    // holding its NBD device, so it is killed before slots start. Processes
+    // of journaled sessions and their descendants (nbd-client run by
+    // nbdkit) are spared.
+    static void reapOrphans(const std::vector<std::string>& slots)
+    {
+        std::set<pid_t> kept;
+        for (const auto& slot : slots)
+        {
+            if (auto entry = load(slot))
+            {
+                kept.insert(entry->pid);
+            }
+        }
+
+        const auto cgroup = ownCgroup();
+        if (!cgroup)
+        {
+            return;
+        }
+        std::ifstream procs(*cgroup / "cgroup.procs");
+        pid_t pid;
+        while (procs >> pid)
+        {
+            if (pid == ::getpid() || descendsFrom(pid, kept))
+            {
+                continue;
+            }
+            LogMsg(Logger::Info, "[SessionJournal]: Killing orphaned process ",
+                   pid);
+            ::kill(pid, SIGKILL);
+        }
+    }
+
+  private:
+    // Unified hierarchy only ("0::/path")
+    static std::optional<fs::path> ownCgroup()
+    {
+        std::ifstream file("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (line.rfind("0::", 0) == 0)
+            {
+                return fs::path("/sys/fs/cgroup") /
+                       fs::path(line.substr(3)).relative_path();
+            }
+        }
+        return {};
+    }
+
+    static pid_t parentOf(pid_t pid)
+    {
+        // Command name may contain spaces, fields follow its closing ')'
+        std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+        std::string stat;
+        std::getline(file, stat);
+        const auto end = stat.rfind(')');
+        if (end == std::string::npos)
+        {
+            return 0;
+        }
+        std::istringstream fields(stat.substr(end + 1));
+        char state;
+        pid_t parent = 0;
+        fields >> state >> parent;
+        return parent;
+    }
+
+    static bool descendsFrom(pid_t pid, const std::set<pid_t>& ancestors)
+    {
+        while (pid > 1)
+        {
+            if (ancestors.count(pid))
+            {
+                return true;
+            }
+            pid = parentOf(pid);
+        }
+        return false;
+    }
+
+    static fs::path entryPath(const std::string& slot)
+    {
+        return directory / (slot + ".json");
+    }
+
+    static inline fs::path directory;
+};
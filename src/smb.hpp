@@ -2,11 +2,22 @@
 
 #include "logger.hpp"
 #include "utils.hpp"
+#include "worker_pool.hpp"
 
+#include <openssl/evp.h>
 #include <sys/mount.h>
 
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <charconv>
 #include <filesystem>
+#include <map>
+#include <memory>
 #include <optional>
+#include <string>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -16,12 +27,53 @@ class SmbShare
     SmbShare(const fs::path& mountDir) : mountDir(mountDir)
     {}
 
-    bool mount(const fs::path& remote, bool rw,
-               const std::unique_ptr<utils::CredentialsProvider>& credentials)
+    // Tunables of CIFS client, unset ones are left at kernel defaults
+    struct Options
     {
-        LogMsg(Logger::Debug, "Trying to mount remote : ", remote);
+        std::string version = "3.0";
+        std::optional<std::string> cache;
+        std::optional<uint32_t> rsize;
+        std::optional<uint32_t> wsize;
+        std::optional<uint32_t> actimeo;
+
+        static bool isValidVersion(const std::string& version)
+        {
+            static const std::vector<std::string> versions = {
+                "1.0", "2.0", "2.1", "3", "3.0", "3.02", "3.1.1", "default"};
+            return std::find(versions.cbegin(), versions.cend(), version) !=
+                   versions.cend();
+        }
 
-        const std::string params = "sec=ntlmsspi,seal,vers=3.0";
+        static bool isValidCache(const std::string& cache)
+        {
+            return cache == "strict" || cache == "loose" || cache == "none";
+        }
+    };
+
+    // Options are prepared upfront, so credentials are not accessed from
+    // worker thread doing the mount itself
+    static std::string
+        mountOptions(bool rw,
+                     const std::unique_ptr<utils::CredentialsProvider>& credentials,
+                     const Options& tunables)
+    {
+        std::string params = "sec=ntlmsspi,seal,vers=" + tunables.version;
+        if (tunables.cache)
+        {
+            params += ",cache=" + *tunables.cache;
+        }
+        if (tunables.rsize)
+        {
+            params += ",rsize=" + std::to_string(*tunables.rsize);
+        }
+        if (tunables.wsize)
+        {
+            params += ",wsize=" + std::to_string(*tunables.wsize);
+        }
+        if (tunables.actimeo)
+        {
+            params += ",actimeo=" + std::to_string(*tunables.actimeo);
+        }
         const std::string perm = rw ? "rw" : "ro";
         auto options = params + "," + perm;
         LogMsg(Logger::Debug, "Mounting with options: ", options);
@@ -40,12 +92,19 @@ class SmbShare
         }
 
         options += "," + credentialsOpt;
+        utils::secureCleanup(credentialsOpt);
+        return options;
+    }
+
+    // Blocks until SMB negotiation finishes, options are wiped afterwards
+    bool mount(const fs::path& remote, std::string& options)
+    {
+        LogMsg(Logger::Debug, "Trying to mount remote : ", remote);
 
         auto ec = ::mount(remote.c_str(), mountDir.c_str(), "cifs", 0,
                           options.c_str());
 
         utils::secureCleanup(options);
-        utils::secureCleanup(credentialsOpt);
 
         if (ec)
         {
@@ -57,9 +116,14 @@ class SmbShare
         return true;
     }
 
+    static fs::path mountDirPath(const fs::path& name)
+    {
+        return fs::temp_directory_path() / name;
+    }
+
     static std::optional<fs::path> createMountDir(const fs::path& name)
     {
-        auto destPath = fs::temp_directory_path() / name;
+        auto destPath = mountDirPath(name);
         std::error_code ec;
 
         if (fs::exists(destPath))
@@ -83,13 +147,23 @@ class SmbShare
         std::error_code ec;
 
         result = ::umount(mountDir.string().c_str());
-        if (result)
+        if (result && errno == EBUSY)
         {
-            LogMsg(Logger::Error, result, " : Unable to unmout directory ",
-                   mountDir);
+            // Image may still be open by I/O finishing on worker thread,
+            // detach the share now and let the kernel finish it later
+            result = ::umount2(mountDir.string().c_str(), MNT_DETACH);
+        }
+        // Not mounted at all (EINVAL) is fine, anything else leaves share
+        // in place and directory must not be touched
+        if (result && errno != EINVAL)
+        {
+            LogMsg(Logger::Error, "Unable to unmount directory ", mountDir,
+                   " errno = ", errno);
+            return;
         }
 
-        if (!fs::remove_all(mountDir, ec))
+        // Never recursive, share may be rw
+        if (!fs::remove(mountDir, ec))
         {
             LogMsg(Logger::Error, ec, " : Unable to remove mount directory ",
                    mountDir);
@@ -99,3 +173,181 @@ class SmbShare
   private:
     std::string mountDir;
 };
+
+// Mounts CIFS shares on worker threads and shares them between mount points.
+// Mount points using the same share with the same options (including access
+// mode and credentials) get the same mount, so kernel keeps single SMB session
+// for them. Share is unmounted when last of its users releases it.
+class SmbShareManager
+{
+  public:
+    SmbShareManager(boost::asio::io_context& ioc, WorkerPool& workers) :
+        ioc(ioc), workers(workers)
+    {}
+
+    SmbShareManager(const SmbShareManager&) = delete;
+    SmbShareManager& operator=(const SmbShareManager&) = delete;
+
+    // Returns directory share is mounted at, options are wiped when done.
+    // Concurrent requests for the same share wait for the first mount.
+    std::optional<fs::path> acquire(const fs::path& remote,
+                                    std::string& options,
+                                    boost::asio::yield_context yield)
+    {
+        const std::string key = remote.string() + "|" + digest(options);
+
+        auto it = shares.find(key);
+        if (it != shares.end())
+        {
+            utils::secureCleanup(options);
+            auto share = it->second;
+            share->users++;
+            while (share->mounting)
+            {
+                boost::system::error_code ignored_ec;
+                share->done.async_wait(yield[ignored_ec]);
+            }
+            if (share->mounted)
+            {
+                LogMsg(Logger::Info, "[SmbShareManager]: Reusing ", remote,
+                       " mounted at ", share->mountDir, ", ", share->users,
+                       " users");
+                return share->mountDir;
+            }
+            share->users--;
+            return {};
+        }
+
+        auto share = std::make_shared<Share>(
+            ioc, SmbShare::mountDirPath("smb" + std::to_string(nextId++)));
+        shares.emplace(key, share);
+        byMountDir[share->mountDir] = key;
+
+        share->mounted = runBlocking(
+            workers.executor(),
+            [mountDir = share->mountDir, remote,
+             options = std::move(options)]() mutable {
+                auto created = SmbShare::createMountDir(mountDir.filename());
+                if (!created)
+                {
+                    utils::secureCleanup(options);
+                    return false;
+                }
+                SmbShare smb(*created);
+                if (!smb.mount(remote, options))
+                {
+                    std::error_code ec;
+                    fs::remove_all(*created, ec);
+                    return false;
+                }
+                return true;
+            },
+            yield);
+        utils::secureCleanup(options);
+        share->mounting = false;
+        share->done.cancel();
+
+        if (!share->mounted)
+        {
+            // Waiters already hold the share, stop handing it out
+            forget(share->mountDir);
+            return {};
+        }
+        return share->mountDir;
+    }
+
+    void release(const fs::path& mountDir)
+    {
+        const auto keyIt = byMountDir.find(mountDir);
+        if (keyIt == byMountDir.end())
+        {
+            LogMsg(Logger::Error, "[SmbShareManager]: Unknown share at ",
+                   mountDir);
+            return;
+        }
+        const auto it = shares.find(keyIt->second);
+        if (--it->second->users > 0)
+        {
+            return;
+        }
+        forget(mountDir);
+        boost::asio::post(workers.executor(),
+                          [mountDir]() { SmbShare::unmount(mountDir); });
+    }
+
+    // Share mounted by previous instance of the daemon. Its options are not
+    // known anymore, so it is never handed out to another mount.
+    void adopt(const fs::path& mountDir)
+    {
+        auto share = std::make_shared<Share>(ioc, mountDir);
+        share->mounting = false;
+        share->mounted = true;
+        const std::string key = "adopted|" + mountDir.string();
+        shares[key] = share;
+        byMountDir[mountDir] = key;
+
+        const std::string dirName = mountDir.filename().string();
+        uint64_t id = 0;
+        if (dirName.starts_with("smb") &&
+            std::from_chars(dirName.data() + 3,
+                            dirName.data() + dirName.size(), id)
+                    .ec == std::errc())
+        {
+            nextId = std::max(nextId, id + 1);
+        }
+        LogMsg(Logger::Info, "[SmbShareManager]: Adopted share at ", mountDir);
+    }
+
+  private:
+    struct Share
+    {
+        Share(boost::asio::io_context& ioc, const fs::path& mountDir) :
+            mountDir(mountDir), done(ioc, boost::asio::steady_timer::time_point::max())
+        {}
+
+        fs::path mountDir;
+        unsigned users = 1;
+        bool mounting = true;
+        bool mounted = false;
+        // Cancelled when mount finishes
+        boost::asio::steady_timer done;
+    };
+
+    void forget(const fs::path& mountDir)
+    {
+        const auto keyIt = byMountDir.find(mountDir);
+        if (keyIt != byMountDir.end())
+        {
+            shares.erase(keyIt->second);
+            byMountDir.erase(keyIt);
+        }
+    }
+
+    // Options contain password, only its digest is kept around
+    static std::string digest(const std::string& options)
+    {
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        if (!EVP_Digest(options.data(), options.size(), md, &length,
+                        EVP_sha256(), nullptr))
+        {
+            // Unable to tell whether options match, never reuse
+            return "unique" + std::to_string(uniqueDigests++);
+        }
+        static constexpr const char hex[] = "0123456789abcdef";
+        std::string result;
+        for (unsigned int i = 0; i < length; i++)
+        {
+            result += hex[md[i] >> 4];
+            result += hex[md[i] & 0x0f];
+        }
+        return result;
+    }
+
+    boost::asio::io_context& ioc;
+    WorkerPool& workers;
+    uint64_t nextId = 0;
+    static inline uint64_t uniqueDigests = 0;
+    std::map<std::string, std::shared_ptr<Share>> shares;
+    std::map<fs::path, std::string> byMountDir;
+};
@@ -0,0 +1,621 @@
+#pragma once
+
+#include "https_backend.hpp"
+#include "logger.hpp"
+#include "nbd_server.hpp"
+#include "worker_pool.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nbd
+{
+
+// Remote images kept on local storage (eMMC, tmpfs) across mounts and
+// restarts. Every image is a sparse file of fixed-size chunks, named by
+// digest of its URL, with JSON index of chunks present next to it. Content is
+// reused only while server reports the same ETag (or Last-Modified) and size.
+// All images share single byte budget, least recently used chunks are punched
+// out of their files when it is exceeded.
+class SpillCache
+{
+  public:
+    static constexpr const uint64_t chunkSize = 1024 * 1024;
+
+    struct Image
+    {
+        std::string key;
+        std::string url;
+        std::string validator;
+        uint64_t size = 0;
+        int fd = -1;
+        // Chunk index -> position in LRU
+        std::unordered_map<uint64_t, std::list<std::pair<Image*, uint64_t>>::
+                                         iterator>
+            resident;
+        // Chunks being read from the file can't be evicted
+        std::unordered_map<uint64_t, unsigned> pinned;
+        bool dirty = false;
+        // Replaced by newer version, files are gone already
+        bool dropped = false;
+
+        ~Image()
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+
+        fs::path dataPath(const fs::path& directory) const
+        {
+            return directory / (key + ".data");
+        }
+
+        fs::path indexPath(const fs::path& directory) const
+        {
+            return directory / (key + ".json");
+        }
+    };
+
+    // Returns nullptr when cache directory is not usable
+    static std::unique_ptr<SpillCache> create(boost::asio::io_context& ioc,
+                                              const fs::path& directory,
+                                              uint64_t budget,
+                                              WorkerPool& workers)
+    {
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[SpillCache]: Unable to create ", directory,
+                   ": ", ec);
+            return {};
+        }
+        std::unique_ptr<SpillCache> cache(
+            new SpillCache(ioc, directory, budget, workers));
+        cache->load();
+        current = cache.get();
+        return cache;
+    }
+
+    static SpillCache* instance()
+    {
+        return current;
+    }
+
+    SpillCache(const SpillCache&) = delete;
+    SpillCache& operator=(const SpillCache&) = delete;
+
+    ~SpillCache()
+    {
+        if (current == this)
+        {
+            current = nullptr;
+        }
+        saveDirty();
+    }
+
+    // Image with unknown validator can't be told apart from its newer
+    // version, so it is not cached at all
+    std::shared_ptr<Image> open(const std::string& url,
+                                const std::string& validator, uint64_t size)
+    {
+        const std::string key = digest(url);
+        if (validator.empty() || key.empty() || size == 0)
+        {
+            return {};
+        }
+
+        auto it = images.find(key);
+        if (it != images.end() &&
+            (it->second->validator != validator || it->second->size != size))
+        {
+            LogMsg(Logger::Info, "[SpillCache]: ", url,
+                   " changed, dropping cached content");
+            drop(it->second);
+            images.erase(it);
+            it = images.end();
+        }
+        if (it == images.end())
+        {
+            auto image = std::make_shared<Image>();
+            image->key = key;
+            image->url = url;
+            image->validator = validator;
+            image->size = size;
+            image->dirty = true;
+            it = images.emplace(key, std::move(image)).first;
+        }
+
+        auto& image = it->second;
+        if (image->fd < 0)
+        {
+            const fs::path path = image->dataPath(directory);
+            image->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            if (image->fd < 0 ||
+                ::ftruncate(image->fd, static_cast<off_t>(size)) < 0)
+            {
+                LogMsg(Logger::Error, "[SpillCache]: Unable to open ", path,
+                       " errno = ", errno);
+                drop(image);
+                images.erase(key);
+                return {};
+            }
+        }
+        LogMsg(Logger::Debug, "[SpillCache]: ", url, " has ",
+               image->resident.size(), " chunks cached");
+        return image;
+    }
+
+    bool contains(const Image& image, uint64_t index) const
+    {
+        return image.resident.count(index) > 0;
+    }
+
+    // Copies part of resident chunk out of the file, returns errno
+    int read(Image& image, uint64_t index, uint64_t offset, char* data,
+             size_t length, boost::asio::yield_context yield)
+    {
+        auto it = image.resident.find(index);
+        if (it == image.resident.end())
+        {
+            return ENOENT;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+
+        image.pinned[index]++;
+        int error = runBlocking(
+            workers.executor(),
+            [fd = image.fd, offset, data, length]() {
+                ssize_t ret = ::pread(fd, data, length, static_cast<off_t>(offset));
+                return ret == static_cast<ssize_t>(length) ? 0 : EIO;
+            },
+            yield);
+        if (--image.pinned[index] == 0)
+        {
+            image.pinned.erase(index);
+        }
+        return error;
+    }
+
+    // Writes fetched chunk in the background, chunk becomes resident once
+    // it is on disk
+    void store(const std::shared_ptr<Image>& image, uint64_t index,
+               std::vector<char>&& data)
+    {
+        if (contains(*image, index) || data.size() > budget)
+        {
+            return;
+        }
+        boost::asio::spawn(
+            ioc, [this, image, index, data = std::move(data)](
+                       boost::asio::yield_context yield) {
+                // Same strand as hole punching, so they can't be reordered
+                int error = runBlocking(
+                    writes,
+                    [fd = image->fd, index, &data]() {
+                        ssize_t ret = ::pwrite(
+                            fd, data.data(), data.size(),
+                            static_cast<off_t>(index * chunkSize));
+                        return ret == static_cast<ssize_t>(data.size()) ? 0
+                                                                        : EIO;
+                    },
+                    yield);
+                if (error || image->dropped || contains(*image, index))
+                {
+                    return;
+                }
+                lru.emplace_front(image.get(), index);
+                image->resident[index] = lru.begin();
+                image->dirty = true;
+                used += data.size();
+                evict();
+                if (++storedSinceSave >= saveInterval)
+                {
+                    saveDirty();
+                }
+            });
+    }
+
+    // Persists index of every image changed since last save
+    void saveDirty()
+    {
+        storedSinceSave = 0;
+        for (auto& [key, image] : images)
+        {
+            if (!image->dirty)
+            {
+                continue;
+            }
+            image->dirty = false;
+            nlohmann::json chunks = nlohmann::json::array();
+            for (auto it = lru.rbegin(); it != lru.rend(); it++)
+            {
+                if (it->first == image.get())
+                {
+                    chunks.push_back(it->second);
+                }
+            }
+            // Least recently used first, so that order survives restart
+            nlohmann::json index = {{"Url", image->url},
+                                    {"Validator", image->validator},
+                                    {"Size", image->size},
+                                    {"ChunkSize", chunkSize},
+                                    {"Chunks", std::move(chunks)}};
+            boost::asio::post(
+                writes, [fd = image->fd, path = image->indexPath(directory),
+                         content = index.dump()]() {
+                    // Data has to be on disk before index claims it is
+                    if (fd >= 0)
+                    {
+                        ::fdatasync(fd);
+                    }
+                    const fs::path temporary = path.string() + ".tmp";
+                    {
+                        std::ofstream file(temporary, std::ios::trunc);
+                        file << content;
+                        if (!file)
+                        {
+                            return;
+                        }
+                    }
+                    std::error_code ec;
+                    fs::rename(temporary, path, ec);
+                });
+        }
+    }
+
+  private:
+    static constexpr const unsigned saveInterval = 64;
+
+    SpillCache(boost::asio::io_context& ioc, const fs::path& directory,
+               uint64_t budget, WorkerPool& workers) :
+        ioc(ioc),
+        directory(directory), budget(budget), workers(workers),
+        writes(workers.makeStrand())
+    {}
+
+    // Index entries are validated against data files, anything not matching
+    // is removed
+    void load()
+    {
+        struct Entry
+        {
+            Image* image;
+            uint64_t index;
+            size_t order;
+        };
+        std::vector<Entry> entries;
+        std::error_code ec;
+        for (const auto& file : fs::directory_iterator(directory, ec))
+        {
+            if (file.path().extension() != ".json")
+            {
+                continue;
+            }
+            auto image = std::make_shared<Image>();
+            image->key = file.path().stem().string();
+            try
+            {
+                std::ifstream stream(file.path());
+                const auto index = nlohmann::json::parse(stream);
+                image->url = index.at("Url").get<std::string>();
+                image->validator = index.at("Validator").get<std::string>();
+                image->size = index.at("Size").get<uint64_t>();
+                if (index.at("ChunkSize").get<uint64_t>() != chunkSize ||
+                    digest(image->url) != image->key ||
+                    fs::file_size(image->dataPath(directory)) != image->size)
+                {
+                    throw std::out_of_range("stale");
+                }
+                const auto& chunks = index.at("Chunks");
+                for (size_t order = 0; order < chunks.size(); order++)
+                {
+                    entries.push_back(
+                        {image.get(), chunks[order].get<uint64_t>(), order});
+                }
+            }
+            catch (const std::exception& e)
+            {
+                LogMsg(Logger::Info, "[SpillCache]: Removing invalid entry ",
+                       file.path());
+                fs::remove(file.path(), ec);
+                fs::remove(image->dataPath(directory), ec);
+                continue;
+            }
+            images.emplace(image->key, std::move(image));
+        }
+
+        // Every index is stored oldest first, recency across images is not
+        // known so they are interleaved
+        std::stable_sort(entries.begin(), entries.end(),
+                         [](const Entry& lhs, const Entry& rhs) {
+                             return lhs.order < rhs.order;
+                         });
+        for (const auto& entry : entries)
+        {
+            if (entry.index * chunkSize >= entry.image->size ||
+                entry.image->resident.count(entry.index))
+            {
+                continue;
+            }
+            lru.emplace_front(entry.image, entry.index);
+            entry.image->resident[entry.index] = lru.begin();
+            used += chunkLength(*entry.image, entry.index);
+        }
+        LogMsg(Logger::Info, "[SpillCache]: ", images.size(), " images, ",
+               used / (1024 * 1024), " MiB cached in ", directory);
+        evict();
+    }
+
+    // Index without evicted chunks is written before their holes are
+    // punched, on the same strand, so restart never trusts punched range
+    void evict()
+    {
+        struct Punch
+        {
+            int fd;
+            uint64_t index;
+            uint64_t length;
+        };
+        std::vector<Punch> punches;
+        auto it = lru.end();
+        while (used > budget && it != lru.begin())
+        {
+            it--;
+            auto [image, index] = *it;
+            if (image->pinned.count(index))
+            {
+                continue;
+            }
+            used -= chunkLength(*image, index);
+            image->resident.erase(index);
+            image->dirty = true;
+            it = lru.erase(it);
+            if (image->fd >= 0)
+            {
+                punches.push_back(
+                    {image->fd, index, chunkLength(*image, index)});
+            }
+        }
+        if (punches.empty())
+        {
+            return;
+        }
+        saveDirty();
+        boost::asio::post(writes, [punches = std::move(punches)]() {
+            for (const auto& punch : punches)
+            {
+                ::fallocate(punch.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            static_cast<off_t>(punch.index * chunkSize),
+                            static_cast<off_t>(punch.length));
+            }
+        });
+    }
+
+    // Forgets image and removes its files, mounts still using it keep their
+    // descriptor until they are done
+    void drop(const std::shared_ptr<Image>& image)
+    {
+        for (auto& [index, position] : image->resident)
+        {
+            used -= chunkLength(*image, index);
+            lru.erase(position);
+        }
+        image->resident.clear();
+        image->dropped = true;
+        image->dirty = false;
+        // Data file goes right away, newer version opened next at the same
+        // path gets its own file. Queued writes keep using the old one.
+        std::error_code ec;
+        fs::remove(image->dataPath(directory), ec);
+        // Index is removed after its queued saves but before any save of
+        // newer version
+        boost::asio::post(writes, [index = image->indexPath(directory)]() {
+            std::error_code ec;
+            fs::remove(index, ec);
+        });
+    }
+
+    static uint64_t chunkLength(const Image& image, uint64_t index)
+    {
+        return std::min(chunkSize, image.size - index * chunkSize);
+    }
+
+    static std::string digest(const std::string& url)
+    {
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        if (!EVP_Digest(url.data(), url.size(), md, &length, EVP_sha256(),
+                        nullptr))
+        {
+            return {};
+        }
+        static constexpr const char hex[] = "0123456789abcdef";
+        std::string result;
+        for (unsigned int i = 0; i < length; i++)
+        {
+            result += hex[md[i] >> 4];
+            result += hex[md[i] & 0x0f];
+        }
+        return result;
+    }
+
+    static inline SpillCache* current = nullptr;
+
+    boost::asio::io_context& ioc;
+    fs::path directory;
+    uint64_t budget;
+    WorkerPool& workers;
+    WorkerPool::Strand writes;
+    uint64_t used = 0;
+    unsigned storedSinceSave = 0;
+    std::map<std::string, std::shared_ptr<Image>> images;
+    std::list<std::pair<Image*, uint64_t>> lru;
+};
+
+// Serves remote image through spill cache, only chunks not cached yet are
+// fetched from the server, whole chunk at a time
+class SpillCachedBackend : public Backend
+{
+  public:
+    SpillCachedBackend(std::shared_ptr<HttpsBackend> inner, SpillCache& cache,
+                       const std::string& url) :
+        inner(std::move(inner)),
+        cache(cache), url(url)
+    {}
+
+    bool initialize(boost::asio::yield_context yield) override
+    {
+        if (!inner->initialize(yield))
+        {
+            return false;
+        }
+        image = cache.open(url, inner->validator(), inner->size());
+        if (!image)
+        {
+            LogMsg(Logger::Info, "[SpillCachedBackend]: ", url,
+                   " can't be cached, no ETag nor Last-Modified");
+        }
+        return true;
+    }
+
+    void close() override
+    {
+        closed = true;
+        inner->close();
+        if (image)
+        {
+            cache.saveDirty();
+            image.reset();
+        }
+    }
+
+    uint64_t size() const override
+    {
+        return inner->size();
+    }
+
+    bool readOnly() const override
+    {
+        return true;
+    }
+
+    unsigned concurrency() const override
+    {
+        return inner->concurrency();
+    }
+
+    int read(uint64_t offset, char* data, size_t length,
+             boost::asio::yield_context yield) override
+    {
+        if (!image || length == 0)
+        {
+            return inner->read(offset, data, length, yield);
+        }
+
+        const uint64_t last = (offset + length - 1) / SpillCache::chunkSize;
+        uint64_t index = offset / SpillCache::chunkSize;
+        while (index <= last)
+        {
+            if (closed)
+            {
+                return ESHUTDOWN;
+            }
+            if (cache.contains(*image, index))
+            {
+                const auto [begin, end] = overlap(index, index + 1, offset,
+                                                  length);
+                if (cache.read(*image, index, begin, data + (begin - offset),
+                               end - begin, yield) == 0)
+                {
+                    index++;
+                    continue;
+                }
+            }
+
+            // Run of missing chunks is fetched with single request
+            uint64_t end = index + 1;
+            while (end <= last && !cache.contains(*image, end))
+            {
+                end++;
+            }
+            int error = fetch(index, end, offset, data, length, yield);
+            if (error)
+            {
+                return error;
+            }
+            index = end;
+        }
+        return 0;
+    }
+
+  private:
+    // Part of request [offset, offset + length) within chunks [begin, end)
+    std::pair<uint64_t, uint64_t> overlap(uint64_t begin, uint64_t end,
+                                          uint64_t offset, size_t length) const
+    {
+        return {std::max(offset, begin * SpillCache::chunkSize),
+                std::min({offset + length, end * SpillCache::chunkSize,
+                          inner->size()})};
+    }
+
+    int fetch(uint64_t begin, uint64_t end, uint64_t offset, char* data,
+              size_t length, boost::asio::yield_context yield)
+    {
+        const uint64_t fetchBegin = begin * SpillCache::chunkSize;
+        const uint64_t fetchEnd =
+            std::min(end * SpillCache::chunkSize, inner->size());
+        std::vector<char> buffer(fetchEnd - fetchBegin);
+        int error = inner->read(fetchBegin, buffer.data(), buffer.size(), yield);
+        if (error)
+        {
+            return error;
+        }
+        if (closed)
+        {
+            return ESHUTDOWN;
+        }
+
+        const auto [copyBegin, copyEnd] = overlap(begin, end, offset, length);
+        std::copy(buffer.begin() + (copyBegin - fetchBegin),
+                  buffer.begin() + (copyEnd - fetchBegin),
+                  data + (copyBegin - offset));
+
+        for (uint64_t index = begin; index < end; index++)
+        {
+            const auto chunkBegin =
+                buffer.begin() + (index - begin) * SpillCache::chunkSize;
+            const auto chunkEnd = (index + 1 == end)
+                                      ? buffer.end()
+                                      : chunkBegin + SpillCache::chunkSize;
+            cache.store(image, index, std::vector<char>(chunkBegin, chunkEnd));
+        }
+        return 0;
+    }
+
+    std::shared_ptr<HttpsBackend> inner;
+    SpillCache& cache;
+    std::string url;
+    std::shared_ptr<SpillCache::Image> image;
+    bool closed = false;
+};
+
+} // namespace nbd
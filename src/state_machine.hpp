@@ -1,10 +1,21 @@
 #pragma once
 
+#include "block_cache.hpp"
 #include "configuration.hpp"
+#include "https_backend.hpp"
+#include "io_scheduler.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "nbd_server.hpp"
+#include "overlay.hpp"
+#include "proxy_relay.hpp"
+#include "session_journal.hpp"
 #include "smb.hpp"
+#include "spill_cache.hpp"
 #include "system.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
+#include "worker_pool.hpp"
 
 #include <sys/mount.h>
 
@@ -13,6 +24,7 @@
 
 #include <filesystem>
 #include <functional>
+#include <map>
 #include <memory>
 #include <optional>
 #include <stdexcept>
@@ -22,6 +34,15 @@
 using namespace phosphor::logging;
 struct MountPointStateMachine
 {
+#ifdef VM_SYSTEM_SEAMS
+    // Benchmark build (bench/) replaces system interaction with mocks
+    using Process = seams::Process;
+    using DeviceMonitor = seams::DeviceMonitor;
+    using UsbGadget = seams::UsbGadget;
+    using UdevGadget = seams::UdevGadget;
+    using Medium = seams::Medium;
+#endif
+
     struct InvalidStateError : std::runtime_error
     {
         InvalidStateError(const char* what) : std::runtime_error(what)
@@ -98,13 +119,26 @@ struct MountPointStateMachine
             if (machine.target)
             {
                 // Cleanup after previously mounted device
+                if (machine.target->nbdServer)
+                {
+                    machine.target->nbdServer->stop();
+                }
                 if (machine.target->mountDir)
                 {
-                    SmbShare::unmount(*machine.target->mountDir);
+                    machine.smbShares.release(*machine.target->mountDir);
                 }
 
                 machine.target.reset();
             }
+            if (machine.proxyRelay)
+            {
+                machine.proxyRelay->stop();
+                machine.proxyRelay.reset();
+            }
+            machine.ioFlow.reset();
+            machine.releaseNbdDevice();
+            machine.journaled = false;
+            SessionJournal::remove(machine.name);
         }
 
         std::optional<Error> error;
@@ -118,11 +152,26 @@ struct MountPointStateMachine
 
         virtual void onEnter()
         {
+            // State is entered again while waiting for share to be mounted
+            if (started)
+            {
+                return;
+            }
+            started = true;
+            machine.activationId++;
+            // Metrics describe current (or most recent) mount
+            machine.ioMetrics = IoMetrics();
+            machine.cacheStats = nbd::CacheStats();
+            machine.deviceBaseline.reset();
+
             // Reset previous exit code
             machine.exitCode = -1;
+            machine.cdrom.reset();
 
             machine.emitActivationStartedEvent();
         }
+
+        bool started = false;
     };
 
     struct WaitingForGadgetState : public BasicState
@@ -141,6 +190,11 @@ struct MountPointStateMachine
         ActiveState(const WaitingForGadgetState& state) :
             BasicState(state, __FUNCTION__), process{state.process} {};
 
+        virtual void onEnter()
+        {
+            machine.journalSession(process);
+        }
+
         std::weak_ptr<Process> process;
     };
 
@@ -224,8 +278,16 @@ struct MountPointStateMachine
             addMountPointInterface(state);
             addProcessInterface(state);
             addServiceInterface(state, isLegacy);
+            addMetricsInterface(state);
+            if (auto adopted = state.machine.adoptSession(state))
+            {
+                return std::move(*adopted);
+            }
             // Workaround for HSD18020136609. Details in system.hpp.
-            UdevGadget::forceUdevChange();
+            if (state.machine.config.nbdDevice)
+            {
+                UdevGadget::forceUdevChange(state.machine.config.nbdDevice);
+            }
             return ReadyState(state);
         }
 
@@ -250,6 +312,61 @@ struct MountPointStateMachine
             return getObjectPath(state.machine);
         }
 
+        // Properties are refreshed periodically instead of on every request,
+        // which limits PropertiesChanged signals to one per interval
+        void addMetricsInterface(const InitialState& state)
+        {
+            std::string objPath = getObjectPath(state);
+
+            auto iface = objServer->add_interface(
+                objPath + state.machine.name,
+                "xyz.openbmc_project.VirtualMedia.Metrics");
+            // Served from snapshot, publishMetrics() emits single signal
+            // with everything changed in the interval
+            const auto addProperty = [&iface, &machine = state.machine](
+                                         const char* name, auto member) {
+                using Type =
+                    std::decay_t<decltype(machine.metrics.*member)>;
+                iface->register_property(
+                    name, Type{}, [](const Type& req, Type& property) { return 0; },
+                    [&machine, member](const Type& property) {
+                        return machine.metrics.*member;
+                    });
+            };
+            addProperty("BytesRead", &Metrics::bytesRead);
+            addProperty("BytesWritten", &Metrics::bytesWritten);
+            addProperty("ReadRequests", &Metrics::readRequests);
+            addProperty("WriteRequests", &Metrics::writeRequests);
+            addProperty("LatencyAvgUs", &Metrics::latencyAvgUs);
+            addProperty("LatencyP50Us", &Metrics::latencyP50Us);
+            addProperty("LatencyP99Us", &Metrics::latencyP99Us);
+            addProperty("CacheHitRate", &Metrics::cacheHitRate);
+            addProperty("StateTimeMs", &Metrics::stateTimeMs);
+            addProperty("QueueDepth", &Metrics::queueDepth);
+            addProperty("Throttled", &Metrics::throttled);
+            // InterfacesAdded already carries initial values, per property
+            // PropertiesChanged would only multiply startup signals
+            iface->initialize(true);
+
+            boost::asio::spawn(
+                state.machine.ioc.get(),
+                [&machine = state.machine,
+                 iface](boost::asio::yield_context yield) {
+                    boost::asio::steady_timer timer(machine.ioc.get());
+                    while (true)
+                    {
+                        timer.expires_after(metricsInterval);
+                        boost::system::error_code ec;
+                        timer.async_wait(yield[ec]);
+                        if (ec)
+                        {
+                            return;
+                        }
+                        machine.publishMetrics();
+                    }
+                });
+        }
+
         void addProcessInterface(const InitialState& state)
         {
             std::string objPath = getObjectPath(state);
@@ -262,14 +379,7 @@ struct MountPointStateMachine
                 "Active", bool(false),
                 [](const bool& req, bool& property) { return 0; },
                 [&machine = state.machine](const bool& property) {
-                    if (std::get_if<ActiveState>(&machine.state))
-                    {
-                        return true;
-                    }
-                    else
-                    {
-                        return false;
-                    }
+                    return machine.properties.active;
                 });
             processIface->register_property(
                 "ExitCode", int32_t(0),
@@ -284,7 +394,7 @@ struct MountPointStateMachine
                     return req;
                 },
                 [](int32_t& property) -> int32_t { return property; });
-            processIface->initialize();
+            processIface->initialize(true);
         }
 
         void addMountPointInterface(const InitialState& state)
@@ -295,7 +405,15 @@ struct MountPointStateMachine
                 objPath + state.machine.name,
                 "xyz.openbmc_project.VirtualMedia.MountPoint");
             iface->register_property(
-                "Device", state.machine.config.nbdDevice.to_string());
+                "Device", std::string(""),
+                [](const std::string& req, std::string& property) {
+                    property = req;
+                    return -1;
+                },
+                [&machine = state.machine](const std::string& property) {
+                    // Dynamically allocated device is known only while used
+                    return machine.config.nbdDevice.to_string();
+                });
             iface->register_property("EndpointId",
                                      state.machine.config.endPointId);
             iface->register_property("Socket", state.machine.config.unixSocket);
@@ -307,14 +425,7 @@ struct MountPointStateMachine
                     return -1;
                 },
                 [&machine = state.machine](const std::string& property) {
-                    if (std::get_if<ActiveState>(&machine.state))
-                    {
-                        return std::string(machine.target->imgUrl);
-                    }
-                    else
-                    {
-                        return std::string("");
-                    }
+                    return machine.properties.imageUrl;
                 });
             iface->register_property(
                 "User", std::string(""),
@@ -323,30 +434,51 @@ struct MountPointStateMachine
                     return -1;
                 },
                 [&machine = state.machine](const std::string& property) {
-                    if (std::get_if<ActiveState>(&machine.state))
-                    {
-                        return USER;
-                    }
-                    else
-                    {
-                        return std::string("");
-                    }
+                    return machine.properties.user;
+                });
+            iface->register_property(
+                "CacheHits", uint64_t(0),
+                [](const uint64_t& req, uint64_t& property) { return 0; },
+                [&machine = state.machine](const uint64_t& property) {
+                    return machine.cacheStats.hits;
+                });
+            iface->register_property(
+                "CacheMisses", uint64_t(0),
+                [](const uint64_t& req, uint64_t& property) { return 0; },
+                [&machine = state.machine](const uint64_t& property) {
+                    return machine.cacheStats.misses;
+                });
+            iface->register_property(
+                "TransferSize", uint32_t(0),
+                [](const uint32_t& req, uint32_t& property) { return 0; },
+                [&machine = state.machine](const uint32_t& property) {
+                    // Largest chunk proxy gets at once, 0 without batching
+                    return machine.proxyRelay
+                               ? static_cast<uint32_t>(
+                                     machine.proxyRelay->transferSize())
+                               : uint32_t(0);
+                });
+            iface->register_property(
+                "RemainingInactivityTimeout", uint64_t(0),
+                [](const uint64_t& req, uint64_t& property) { return 0; },
+                [&machine = state.machine](const uint64_t& property) {
+                    return machine.remainingInactivitySeconds();
                 });
             iface->register_property(
                 "WriteProtected", bool(true),
                 [](const bool& req, bool& property) { return 0; },
                 [&machine = state.machine](const bool& property) {
-                    if (!machine.target->rw)
-                    {
-                        return true;
-                    }
-                    else
-                    {
-                        return false;
-                    }
+                    return machine.properties.writeProtected;
+                });
+            // Medium is presented to host as CD-ROM
+            iface->register_property(
+                "Cdrom", bool(false),
+                [](const bool& req, bool& property) { return 0; },
+                [&machine = state.machine](const bool& property) {
+                    return machine.properties.cdrom;
                 });
 
-            iface->initialize();
+            iface->initialize(true);
         }
 
         void addServiceInterface(const InitialState& state, const bool isLegacy)
@@ -374,19 +506,8 @@ struct MountPointStateMachine
                         return false;
                     }
 
-                    boost::asio::steady_timer timer(machine.ioc.get());
-                    int waitCnt = 120;
-                    while (waitCnt > 0)
-                    {
-                        if (std::get_if<ReadyState>(&machine.state))
-                        {
-                            break;
-                        }
-                        boost::system::error_code ignored_ec;
-                        timer.expires_from_now(std::chrono::milliseconds(100));
-                        timer.async_wait(yield[ignored_ec]);
-                        waitCnt--;
-                    }
+                    machine.waitForState<ReadyState>(yield,
+                                                     transitionTimeout);
                     return true;
                 });
 
@@ -403,28 +524,22 @@ struct MountPointStateMachine
                     return false;
                 }
 
-                boost::asio::steady_timer timer(machine.ioc.get());
-                int waitCnt = 120;
-                while (waitCnt > 0)
+                machine.waitForState<ReadyState, ActiveState>(
+                    yield, transitionTimeout);
+
+                if (auto s = std::get_if<ReadyState>(&machine.state))
                 {
-                    if (auto s = std::get_if<ReadyState>(&machine.state))
+                    if (s->error)
                     {
-                        if (s->error)
-                        {
-                            throw sdbusplus::exception::SdBusError(
-                                static_cast<int>(s->error->code),
-                                s->error->message.c_str());
-                        }
-                        return false;
-                    }
-                    if (std::get_if<ActiveState>(&machine.state))
-                    {
-                        return true;
+                        throw sdbusplus::exception::SdBusError(
+                            static_cast<int>(s->error->code),
+                            s->error->message.c_str());
                     }
-                    boost::system::error_code ignored_ec;
-                    timer.expires_from_now(std::chrono::milliseconds(100));
-                    timer.async_wait(yield[ignored_ec]);
-                    waitCnt--;
+                    return false;
+                }
+                if (std::get_if<ActiveState>(&machine.state))
+                {
+                    return true;
                 }
                 return false;
             };
@@ -442,7 +557,9 @@ struct MountPointStateMachine
                         LogMsg(Logger::Info, "[App]: Mount called on ",
                                getObjectPath(machine), machine.name);
 
-                        machine.target = {imgUrl, rw};
+                        // Active mount keeps its target until Mount is
+                        // accepted, new one is prepared aside
+                        Target target{imgUrl, rw};
 
                         if (std::holds_alternative<unix_fd>(fd))
                         {
@@ -473,8 +590,12 @@ struct MountPointStateMachine
                             // Second 'part', after NULL delimiter
                             std::string pass(buf.begin() + user.length() + 1);
 
+                            // Credentials are gone once mounted, user name is
+                            // kept for MountPoint.User
+                            target.user = user;
+
                             // Encapsulate credentials into safe buffer
-                            machine.target->credentials =
+                            target.credentials =
                                 std::make_unique<utils::CredentialsProvider>(
                                     std::move(user), std::move(pass));
 
@@ -482,15 +603,30 @@ struct MountPointStateMachine
                             utils::secureCleanup(buf);
                         }
 
+                        // Pipe read may have yielded, state is checked right
+                        // before Mount event is emitted
+                        if (!std::holds_alternative<ReadyState>(machine.state))
+                        {
+                            throw sdbusplus::exception::SdBusError(
+                                EPERM, "Could not mount on not empty slot");
+                        }
+                        machine.target = std::move(target);
+
+                        const auto dropCredentials = [&machine]() {
+                            if (machine.target)
+                            {
+                                machine.target->credentials.reset();
+                            }
+                        };
                         try
                         {
                             auto ret = handleMount(yield, machine);
-                            machine.target->credentials.reset();
+                            dropCredentials();
                             return ret;
                         }
                         catch (...)
                         {
-                            machine.target->credentials.reset();
+                            dropCredentials();
                             throw;
                             return false;
                         }
@@ -508,9 +644,12 @@ struct MountPointStateMachine
                     });
             }
 
-            iface->initialize();
+            iface->initialize(true);
         }
 
+        // Longest time D-Bus call waits for Mount/Unmount to complete
+        static constexpr const std::chrono::seconds transitionTimeout{12};
+
         std::shared_ptr<sdbusplus::asio::connection> bus;
         std::shared_ptr<sdbusplus::asio::object_server> objServer;
         std::function<void(void)> emitMountEvent;
@@ -600,10 +739,18 @@ struct MountPointStateMachine
 
     struct ActivationStartedEvent : public BasicEvent
     {
+        // Built-in server connections to HTTPS server when not configured
+        static constexpr const uint32_t defaultHttpConnections = 4;
+
         ActivationStartedEvent() : BasicEvent(__FUNCTION__)
         {}
         State operator()(const ActivatingState& state)
         {
+            if (!state.machine.acquireNbdDevice())
+            {
+                return ReadyState(state, std::errc::no_such_device,
+                                  "No free NBD device");
+            }
             if (state.machine.config.mode == Configuration::Mode::proxy)
             {
                 return activateProxyMode(state);
@@ -613,21 +760,17 @@ struct MountPointStateMachine
 
         State activateProxyMode(const ActivatingState& state)
         {
-            auto process = std::make_shared<Process>(
-                state.machine.ioc.get(), state.machine.name,
-                "/usr/sbin/nbd-client", state.machine.config.nbdDevice);
-            if (!process)
+            auto& machine = state.machine;
+            std::shared_ptr<Process> process;
+            if (machine.config.batchFlushKiB)
             {
-                return ReadyState(state, std::errc::operation_canceled,
-                                  "Failed to allocate process");
+                process = startProxyRelay(machine);
             }
-            if (!process->spawn(
-                    Configuration::MountPoint::toArgs(state.machine.config),
-                    [&machine = state.machine](int exitCode, bool isReady) {
-                        LogMsg(Logger::Info, machine.name, " process ended.");
-                        machine.exitCode = exitCode;
-                        machine.emitSubprocessStoppedEvent();
-                    }))
+            else
+            {
+                process = spawnNbdClient(machine);
+            }
+            if (!process)
             {
                 return ReadyState(state, std::errc::operation_canceled,
                                   "Failed to spawn process");
@@ -657,66 +800,225 @@ struct MountPointStateMachine
                               "URL not recognized");
         }
 
+        // Mount may block until SMB negotiation times out, so it is done on
+        // worker thread and machine stays in ActivatingState meanwhile.
+        // Activation continues with ShareMountedEvent.
         State mountSmbShare(const ActivatingState& state)
         {
-            auto mountDir = SmbShare::createMountDir(state.machine.name);
-            if (!mountDir)
-            {
-                return ReadyState(state, std::errc::io_error,
-                                  "Failed to create mount directory");
-            }
-
-            SmbShare smb(*mountDir);
-            fs::path remote = getImagePath(state.machine.target->imgUrl);
+            auto& machine = state.machine;
+            fs::path remote = getImagePath(machine.target->imgUrl);
             auto remoteParent = "/" + remote.parent_path().string();
-            auto localFile = *mountDir / remote.filename();
 
-            LogMsg(Logger::Debug, state.machine.name, " Remote name: ", remote,
-                   "\n Remote parent: ", remoteParent,
-                   "\n Local file: ", localFile);
+            LogMsg(Logger::Debug, machine.name, " Remote name: ", remote,
+                   "\n Remote parent: ", remoteParent);
+
+            // Share is never written when writes go to overlay
+            std::string options = SmbShare::mountOptions(
+                machine.target->rw && !machine.overlayed(),
+                machine.target->credentials,
+                machine.config.smb);
+            boost::asio::spawn(
+                machine.ioc.get(),
+                [&machine, activationId = machine.activationId,
+                 rw = machine.target->rw,
+                 remoteParent = std::move(remoteParent),
+                 options = std::move(options),
+                 imageName = remote.filename()](
+                    boost::asio::yield_context yield) mutable {
+                    auto mountDir =
+                        machine.smbShares.acquire(remoteParent, options, yield);
+                    // Known before nbd-client starts, so block size can
+                    // follow the medium. Target is gone when activation was
+                    // cancelled meanwhile, share is then just released.
+                    std::optional<bool> iso;
+                    if (mountDir && !rw &&
+                        activationId == machine.activationId)
+                    {
+                        iso = runBlocking(
+                            machine.workers.executor(),
+                            [file = *mountDir / imageName]() {
+                                return Medium::isIso(file);
+                            },
+                            yield);
+                    }
+                    machine.emitShareMountedEvent(activationId, mountDir,
+                                                  imageName, iso);
+                });
+            return state;
+        }
+
+        State mountHttpsShare(const ActivatingState& state)
+        {
+            auto& machine = state.machine;
 
-            if (!smb.mount(remoteParent, state.machine.target->rw,
-                           state.machine.target->credentials))
+            std::shared_ptr<Process> process;
+            if (machine.config.builtinNbdServer)
             {
-                fs::remove_all(*mountDir);
-                return ReadyState(state, std::errc::invalid_argument,
-                                  "Failed to mount CIFS share");
+                auto https = std::make_shared<nbd::HttpsBackend>(
+                    machine.ioc.get(), machine.target->imgUrl,
+                    machine.target->credentials,
+                    machine.config.httpConnections.value_or(
+                        defaultHttpConnections));
+                std::shared_ptr<nbd::Backend> backend = https;
+                if (auto cache = nbd::SpillCache::instance())
+                {
+                    backend = std::make_shared<nbd::SpillCachedBackend>(
+                        std::move(https), *cache, machine.target->imgUrl);
+                }
+                if (machine.config.cacheSizeMiB || machine.config.readAheadKiB)
+                {
+                    backend = std::make_shared<nbd::CachedBackend>(
+                        machine.ioc.get(), std::move(backend),
+                        uint64_t(machine.config.cacheSizeMiB) * 1024 * 1024,
+                        uint64_t(machine.config.readAheadKiB) * 1024,
+                        machine.cacheStats);
+                }
+                process = startNbdServer(machine, std::move(backend));
+            }
+            else
+            {
+                process = spawnNbdKit(machine, machine.target->imgUrl);
             }
-
-            auto process = spawnNbdKit(state.machine, localFile);
             if (!process)
             {
-                SmbShare::unmount(*mountDir);
-                return ReadyState(state, std::errc::operation_canceled,
-                                  "Unable to setup NbdKit");
+                return ReadyState(state, std::errc::invalid_argument,
+                                  "Failed to mount HTTPS share");
             }
 
             auto newState = WaitingForGadgetState(state);
             newState.process = process;
-            newState.machine.target->mountDir = *mountDir;
-
             return newState;
         }
 
-        State mountHttpsShare(const ActivatingState& state)
+        static bool removeSocket(MountPointStateMachine& machine)
         {
-            auto& machine = state.machine;
+            // Cleanup of previous socket
+            if (fs::exists(machine.config.unixSocket))
+            {
+                LogMsg(Logger::Debug, machine.name,
+                       " Removing previously mounted socket: ",
+                       machine.config.unixSocket);
+                if (!fs::remove(machine.config.unixSocket))
+                {
+                    LogMsg(Logger::Error, machine.name,
+                           " Unable to remove pre-existing socket :",
+                           machine.config.unixSocket);
+                    return false;
+                }
+            }
+            return true;
+        }
 
-            auto process = spawnNbdKit(machine, machine.target->imgUrl);
+        static std::shared_ptr<Process>
+            spawnNbdClient(MountPointStateMachine& machine)
+        {
+            return spawnNbdClient(machine, machine.nbdClientArgs());
+        }
+
+        static std::shared_ptr<Process>
+            spawnNbdClient(MountPointStateMachine& machine,
+                           const std::vector<std::string>& args)
+        {
+            auto process = std::make_shared<Process>(
+                machine.ioc.get(), machine.name, "/usr/sbin/nbd-client",
+                machine.config.nbdDevice);
+            if (!process->spawn(
+                    args,
+                    [&machine = machine](int exitCode, bool isReady) {
+                        LogMsg(Logger::Info, machine.name, " process ended.");
+                        machine.exitCode = exitCode;
+                        machine.emitSubprocessStoppedEvent();
+                    }))
+            {
+                LogMsg(Logger::Error, machine.name,
+                       " Failed to spawn nbd-client for: ", machine.name);
+                return {};
+            }
+            return process;
+        }
+
+        // nbd-client is connected to relay batching its traffic, relay is
+        // connected to proxy's socket
+        static std::shared_ptr<Process>
+            startProxyRelay(MountPointStateMachine& machine)
+        {
+            auto relay = std::make_shared<ProxyRelay>(
+                machine.ioc.get(), machine.name, machine.config.unixSocket,
+                size_t(machine.config.batchFlushKiB) * 1024,
+                std::chrono::microseconds(machine.config.batchFlushDelayUs));
+            const std::string relaySocket =
+                machine.config.unixSocket + ".relay";
+            if (!relay->start(relaySocket))
+            {
+                return {};
+            }
+
+            Configuration::MountPoint config = machine.config;
+            config.unixSocket = relaySocket;
+            auto process = spawnNbdClient(
+                machine, Configuration::MountPoint::toArgs(config));
             if (!process)
             {
-                return ReadyState(state, std::errc::invalid_argument,
-                                  "Failed to mount HTTPS share");
+                relay->stop();
+                return {};
+            }
+            machine.proxyRelay = std::move(relay);
+            return process;
+        }
+
+        // Serves image from within the daemon, only nbd-client is spawned to
+        // connect the served socket with NBD device
+        static std::shared_ptr<Process>
+            startNbdServer(MountPointStateMachine& machine,
+                           std::shared_ptr<nbd::Backend> backend)
+        {
+            if (!removeSocket(machine))
+            {
+                return {};
             }
 
-            auto newState = WaitingForGadgetState(state);
-            newState.process = process;
-            return newState;
+            if (machine.overlayed())
+            {
+                backend = std::make_shared<nbd::OverlayBackend>(
+                    machine.ioc.get(), std::move(backend),
+                    *machine.config.overlayDirectory,
+                    machine.name, machine.workers.executor());
+            }
+            if (nbd::IoScheduler::instance() || machine.config.rateLimitKiBps)
+            {
+                const uint64_t rate =
+                    uint64_t(machine.config.rateLimitKiBps) * 1024;
+                machine.ioFlow = std::make_shared<nbd::IoScheduler::Flow>(
+                    machine.ioc.get(), machine.config.ioWeight, rate,
+                    machine.config.rateBurstKiB
+                        ? uint64_t(machine.config.rateBurstKiB) * 1024
+                        : rate);
+                backend = std::make_shared<nbd::ScheduledBackend>(
+                    std::move(backend), machine.ioFlow);
+            }
+
+            auto server = std::make_shared<nbd::Server>(
+                machine.ioc.get(), machine.name, std::move(backend),
+                machine.ioMetrics);
+            if (!server->start(machine.config.unixSocket))
+            {
+                return {};
+            }
+
+            auto process = spawnNbdClient(machine);
+            if (!process)
+            {
+                server->stop();
+                return {};
+            }
+
+            machine.target->nbdServer = std::move(server);
+            return process;
         }
 
         static std::shared_ptr<Process>
             spawnNbdKit(MountPointStateMachine& machine,
-                        std::unique_ptr<utils::VolatileFile>&& secret,
+                        std::unique_ptr<utils::SecretFile>&& secret,
                         const std::vector<std::string>& params)
         {
             // Investigate
@@ -730,25 +1032,14 @@ struct MountPointStateMachine
                 return {};
             }
 
-            // Cleanup of previous socket
-            if (fs::exists(machine.config.unixSocket))
+            if (!removeSocket(machine))
             {
-                LogMsg(Logger::Debug, machine.name,
-                       " Removing previously mounted socket: ",
-                       machine.config.unixSocket);
-                if (!fs::remove(machine.config.unixSocket))
-                {
-                    LogMsg(Logger::Error, machine.name,
-                           " Unable to remove pre-existing socket :",
-                           machine.config.unixSocket);
-                    return {};
-                }
+                return {};
             }
 
             std::string nbd_client =
                 "/usr/sbin/nbd-client " +
-                boost::algorithm::join(
-                    Configuration::MountPoint::toArgs(machine.config), " ");
+                boost::algorithm::join(machine.nbdClientArgs(), " ");
 
             std::vector<std::string> args = {
                 // Listen for client on this unix socket...
@@ -768,10 +1059,34 @@ struct MountPointStateMachine
             {
                 args.push_back("--readonly");
             }
+            else if (machine.overlayed())
+            {
+                // Plugin is opened read-only, writes stay in filter's overlay
+                args.push_back("--filter=cow");
+            }
+
+            if (machine.config.rateLimitKiBps)
+            {
+                args.push_back("--filter=rate");
+            }
 
             // Insert extra params
             args.insert(args.end(), params.begin(), params.end());
 
+            if (machine.config.rateLimitKiBps)
+            {
+                // Filter takes bits per second and burst as seconds of rate
+                const uint32_t rate = machine.config.rateLimitKiBps;
+                args.push_back("rate=" + std::to_string(uint64_t(rate) * 8192));
+                if (machine.config.rateBurstKiB)
+                {
+                    args.push_back(
+                        "burstiness=" +
+                        std::to_string(double(machine.config.rateBurstKiB) /
+                                       rate));
+                }
+            }
+
             if (!process->spawn(
                     args, [&machine = machine, secret = std::move(secret)](
                               int exitCode, bool isReady) {
@@ -801,27 +1116,50 @@ struct MountPointStateMachine
         static std::shared_ptr<Process>
             spawnNbdKit(MountPointStateMachine& machine, const std::string& url)
         {
-            std::unique_ptr<utils::VolatileFile> secret;
-            std::vector<std::string> params = {
-                // Use curl plugin ...
-                "curl", "sslverify=false",
-                // ... to mount http resource at url
-                "url=" + url};
+            std::unique_ptr<utils::SecretFile> secret;
+            std::vector<std::string> params;
+
+            // Filters have to precede plugin name
+            if (machine.config.readAheadKiB)
+            {
+                params.push_back("--filter=readahead");
+            }
+            if (machine.config.cacheSizeMiB || machine.config.readAheadKiB)
+            {
+                params.push_back("--filter=cache");
+            }
+
+            params.insert(params.end(),
+                          {// Use curl plugin ...
+                           "curl", "sslverify=false",
+                           // ... to mount http resource at url
+                           "url=" + url});
+
+            if (machine.config.httpConnections)
+            {
+                params.push_back(
+                    "connections=" +
+                    std::to_string(*machine.config.httpConnections));
+            }
+            if (machine.config.cacheSizeMiB)
+            {
+                params.push_back("cache-max-size=" +
+                                 std::to_string(machine.config.cacheSizeMiB) +
+                                 "M");
+            }
 
             // Authenticate if needed
             if (machine.target->credentials)
             {
-                // Pack password into buffer
-                utils::CredentialsProvider::SecureBuffer buff =
-                    machine.target->credentials->pack(
-                        [](const std::string& user, const std::string& pass,
-                           std::vector<char>& buff) {
-                            std::copy(pass.begin(), pass.end(),
-                                      std::back_inserter(buff));
-                        });
-
-                // Prepare file to provide the password with
-                secret = std::make_unique<utils::VolatileFile>(std::move(buff));
+                // Password goes straight from credentials to memory file
+                secret = utils::SecretFile::create(
+                    machine.target->credentials->password());
+                if (!secret)
+                {
+                    LogMsg(Logger::Error, machine.name,
+                           " Unable to prepare password, errno = ", errno);
+                    return {};
+                }
 
                 params.push_back("user=" + machine.target->credentials->user());
                 params.push_back("password=+" + secret->path());
@@ -902,6 +1240,68 @@ struct MountPointStateMachine
         }
     };
 
+    struct ShareMountedEvent : public BasicEvent
+    {
+        ShareMountedEvent(const fs::path& mountDir, const fs::path& imageName) :
+            BasicEvent(__FUNCTION__), localFile(mountDir / imageName)
+        {}
+
+        State operator()(const ActivatingState& state)
+        {
+            LogMsg(Logger::Debug, state.machine.name, " Local file: ",
+                   localFile);
+
+            std::shared_ptr<Process> process;
+            if (state.machine.config.builtinNbdServer)
+            {
+                process = ActivationStartedEvent::startNbdServer(
+                    state.machine,
+                    std::make_shared<nbd::FileBackend>(
+                        localFile,
+                        state.machine.target->rw && !state.machine.overlayed(),
+                        state.machine.workers.executor()));
+            }
+            else
+            {
+                process =
+                    ActivationStartedEvent::spawnNbdKit(state.machine, localFile);
+            }
+            if (!process)
+            {
+                return ReadyState(state, std::errc::operation_canceled,
+                                  "Unable to setup NbdKit");
+            }
+
+            auto newState = WaitingForGadgetState(state);
+            newState.process = process;
+            return newState;
+        }
+
+        fs::path localFile;
+    };
+
+    struct ShareMountFailedEvent : public BasicEvent
+    {
+        ShareMountFailedEvent() : BasicEvent(__FUNCTION__)
+        {}
+
+        State operator()(const ActivatingState& state)
+        {
+            return ReadyState(state, std::errc::invalid_argument,
+                              "Failed to mount CIFS share");
+        }
+    };
+
+    struct MediumProbedEvent : public BasicEvent
+    {
+        MediumProbedEvent() : BasicEvent(__FUNCTION__)
+        {}
+        State operator()(const WaitingForGadgetState& state)
+        {
+            return state.machine.attachGadget(state);
+        }
+    };
+
     struct UdevStateChangeEvent : public BasicEvent
     {
         UdevStateChangeEvent(const StateChange& devState) :
@@ -911,20 +1311,21 @@ struct MountPointStateMachine
         {
             if (devState == StateChange::inserted)
             {
-                int32_t ret = UsbGadget::configure(
-                    state.machine.name, state.machine.config.nbdDevice,
-                    devState,
-                    state.machine.target ? state.machine.target->rw : false);
-                if (ret == 0)
+                if (state.machine.config.maxSectorsKiB)
                 {
-                    // send an event
-                    auto dbusObjectPath = state.machine.getObjectPath() + state.machine.name;
-                    sendEvent(state.machine.bus, MESSAGE_TYPE::RESOURCE_CREATED,
-                            Entry::Level::Informational, std::vector<std::string>{}, dbusObjectPath);
-                    return ActiveState(state);
+                    // Not fatal, kernel default stays in place
+                    BlockQueue::setMaxSectors(
+                        state.machine.config.nbdDevice,
+                        *state.machine.config.maxSectorsKiB);
                 }
-                return ReadyState(state, std::errc::device_or_resource_busy,
-                                  "Unable to configure gadget");
+
+                // Gadget waits for MediumProbedEvent when medium type is
+                // not known yet
+                if (state.machine.probeMedium())
+                {
+                    return state;
+                }
+                return state.machine.attachGadget(state);
             }
             return ReadyState(state, std::errc::operation_not_supported,
                               "Unexpected udev event: " +
@@ -956,11 +1357,85 @@ struct MountPointStateMachine
     };
 
     // Helper functions
+    int32_t insertUsbGadget()
+    {
+        const bool rw = target ? target->rw : false;
+        const bool isCdrom = cdrom.value_or(false);
+        if (config.sharedGadget)
+        {
+            return UsbGadget::attachLun(ports, *config.sharedGadget, config.lun,
+                                        config.nbdDevice.to_path(), rw,
+                                        isCdrom);
+        }
+        if (config.persistentGadget)
+        {
+            return UsbGadget::attach(ports, name, config.nbdDevice.to_path(),
+                                     rw, isCdrom);
+        }
+        return UsbGadget::configure(ports, name, config.nbdDevice,
+                                    StateChange::inserted, rw, isCdrom);
+    }
+
+    State attachGadget(const WaitingForGadgetState& state)
+    {
+        if (insertUsbGadget() == 0)
+        {
+            // send an event
+            auto dbusObjectPath = getObjectPath() + name;
+            sendEvent(bus, MESSAGE_TYPE::RESOURCE_CREATED,
+                      Entry::Level::Informational, std::vector<std::string>{},
+                      dbusObjectPath);
+            return ActiveState(state);
+        }
+        return ReadyState(state, std::errc::device_or_resource_busy,
+                          "Unable to configure gadget");
+    }
+
+    // Read-only medium starting with ISO 9660 volume descriptor is presented
+    // as CD-ROM. Device is read on worker thread, it may take a round trip
+    // to the image. Returns false when there is nothing to probe.
+    bool probeMedium()
+    {
+        if (cdrom || (target && target->rw))
+        {
+            return false;
+        }
+        boost::asio::spawn(
+            ioc.get(), [this, activation = activationId,
+                        path = config.nbdDevice.to_path()](
+                           boost::asio::yield_context yield) {
+                // Device read may be served by built-in server backend using
+                // the shared workers, probing there could starve it
+                boost::asio::thread_pool prober(1);
+                const bool iso = runBlocking(
+                    prober.get_executor(),
+                    [&path]() { return Medium::isIso(path); }, yield);
+                emitMediumProbedEvent(activation, iso);
+            });
+        return true;
+    }
+
+    // Block size follows the medium unless configured explicitly
+    std::vector<std::string> nbdClientArgs() const
+    {
+        if (cdrom.value_or(false) && !config.blocksize)
+        {
+            Configuration::MountPoint effective = config;
+            effective.blocksize = Medium::cdromBlockSize;
+            return Configuration::MountPoint::toArgs(effective);
+        }
+        return Configuration::MountPoint::toArgs(config);
+    }
+
     bool removeUsbGadget(const BasicState& state)
     {
-        int32_t ret = UsbGadget::configure(state.machine.name,
-                                           state.machine.config.nbdDevice,
-                                           StateChange::removed);
+        int32_t ret =
+            config.sharedGadget
+                ? UsbGadget::detachLun(ports, *config.sharedGadget, config.lun)
+            : config.persistentGadget
+                ? UsbGadget::detach(ports, name)
+                : UsbGadget::configure(ports, name, config.nbdDevice,
+                                       StateChange::removed);
         if (ret != 0)
         {
             // This shouldn't ever happen, perhaps best is to restart app
@@ -969,6 +1444,149 @@ struct MountPointStateMachine
         }
         return true;
     }
+    bool acquireNbdDevice()
+    {
+        if (!config.dynamicNbdDevice || config.nbdDevice)
+        {
+            return true;
+        }
+        auto device = nbdDevices.allocate();
+        if (!device)
+        {
+            return false;
+        }
+        config.nbdDevice = *device;
+        watchNbdDevice();
+        return true;
+    }
+
+    // Events of the device are delivered to this machine only
+    void watchNbdDevice()
+    {
+        devMonitor.addDevice(config.nbdDevice, [this](StateChange change) {
+            emitUdevStateChangeEvent(change);
+        });
+    }
+
+    void releaseNbdDevice()
+    {
+        if (!config.dynamicNbdDevice || !config.nbdDevice)
+        {
+            return;
+        }
+        devMonitor.removeDevice(config.nbdDevice);
+        nbdDevices.release(config.nbdDevice);
+        config.nbdDevice = NBDDevice();
+    }
+
+    // Journals session, so it is adopted if the daemon restarts. Sessions
+    // served by the daemon itself end with it, they are never journaled.
+    void journalSession(const std::weak_ptr<Process>& process)
+    {
+        auto ptr = process.lock();
+        journaled = ptr && !proxyRelay && !(target && target->nbdServer);
+        if (!journaled)
+        {
+            SessionJournal::remove(name);
+            return;
+        }
+
+        SessionJournal::Entry entry;
+        entry.pid = ptr->pid();
+        entry.application = ptr->application();
+        entry.device = config.nbdDevice.to_string();
+        if (target)
+        {
+            entry.imageUrl = target->imgUrl;
+            entry.rw = target->rw;
+            entry.user = target->user;
+            entry.mountDir = target->mountDir;
+        }
+        SessionJournal::store(name, entry);
+    }
+
+    // Picks up session journaled by previous instance of the daemon. Process,
+    // NBD device and gadget must all be still in place, otherwise journal is
+    // dropped and slot starts from scratch.
+    std::optional<State> adoptSession(const BasicState& state)
+    {
+        auto entry = SessionJournal::load(name);
+        if (!entry)
+        {
+            return {};
+        }
+        // Journaled again once the session is active
+        SessionJournal::remove(name);
+
+        const std::string expected = config.mode == Configuration::Mode::legacy
+                                         ? "/usr/sbin/nbdkit"
+                                         : "/usr/sbin/nbd-client";
+        const NBDDevice device(entry->device.c_str());
+        if (entry->application != expected || !device ||
+            (!config.dynamicNbdDevice && device != config.nbdDevice) ||
+            !device.isConnected() ||
+            !UsbGadget::isAttached(config.sharedGadget.value_or(name),
+                                   config.lun, device.to_path()))
+        {
+            LogMsg(Logger::Info, name, " Journaled session of ",
+                   entry->device, " is gone");
+            return {};
+        }
+
+        if (config.dynamicNbdDevice)
+        {
+            nbdDevices.claim(device);
+            config.nbdDevice = device;
+            watchNbdDevice();
+        }
+        auto process = std::make_shared<Process>(ioc.get(), name,
+                                                 entry->application,
+                                                 config.nbdDevice);
+        if (!process->adopt(entry->pid, [this](int exitCode, bool isReady) {
+                LogMsg(Logger::Info, name, " process ended.");
+                this->exitCode = exitCode;
+                emitSubprocessStoppedEvent();
+            }))
+        {
+            releaseNbdDevice();
+            return {};
+        }
+
+        if (config.mode == Configuration::Mode::legacy)
+        {
+            target.emplace();
+            target->imgUrl = entry->imageUrl;
+            target->rw = entry->rw;
+            target->user = entry->user;
+            if (entry->mountDir)
+            {
+                smbShares.adopt(*entry->mountDir);
+                target->mountDir = entry->mountDir;
+            }
+        }
+        activationId++;
+        LogMsg(Logger::Info, name, " Adopted session on ",
+               config.nbdDevice.to_string());
+
+        ActiveState active(state);
+        active.process = process;
+        return active;
+    }
+
+    // Persistent gadget is provisioned by App off the event loop. Slot with
+    // adopted session keeps the gadget it already has, shared gadgets are
+    // provisioned by App for all their LUNs at once.
+    bool needsProvisioning() const
+    {
+        return config.persistentGadget && !config.sharedGadget &&
+               !hasSession();
+    }
+
+    bool hasSession() const
+    {
+        return std::holds_alternative<ActiveState>(state);
+    }
+
     void stopProcess(std::weak_ptr<Process> process)
     {
         if (auto ptr = process.lock())
@@ -980,13 +1598,33 @@ struct MountPointStateMachine
     }
 
     MountPointStateMachine(boost::asio::io_context& ioc,
-                           DeviceMonitor& devMonitor, const std::string& name,
+                           DeviceMonitor& devMonitor, VhubPortAllocator& ports,
+                           NBDDeviceAllocator& nbdDevices, WorkerPool& workers,
+                           SmbShareManager& smbShares, const std::string& name,
                            const Configuration::MountPoint& config,
                            std::shared_ptr<sdbusplus::asio::connection>& bus) :
         ioc{ioc},
-        name{name}, config{config}, state{InitialState(*this)}, exitCode{-1}, bus(bus)
+        devMonitor{devMonitor}, ports{ports}, nbdDevices{nbdDevices},
+        workers{workers}, smbShares{smbShares}, name{name}, config{config}, state{InitialState(*this)}, exitCode{-1},
+        bus(bus)
     {
-        devMonitor.addDevice(config.nbdDevice);
+        if (!config.dynamicNbdDevice)
+        {
+            watchNbdDevice();
+            nbdDevices.reserve(config.nbdDevice);
+        }
+    }
+
+    ~MountPointStateMachine()
+    {
+        // Journaled session outlives the daemon
+        if (auto active = std::get_if<ActiveState>(&state); active && journaled)
+        {
+            if (auto process = active->process.lock())
+            {
+                process->release();
+            }
+        }
     }
 
     MountPointStateMachine& operator=(MountPointStateMachine&& machine)
@@ -1010,8 +1648,264 @@ struct MountPointStateMachine
         LogMsg(Logger::Debug, name, " received ", event.eventName, " while in ",
                stateName);
 
+        TraceRing::instance().record(TraceRing::Kind::event, name,
+                                     event.eventName);
         state = std::visit(event, state);
+        accountStateTime(stateName);
         std::visit([](BasicState& state) { state.onEnter(); }, state);
+
+        refreshProperties();
+        notifyTransition();
+    }
+
+    // Suspends until machine enters one of given states or timeout passes.
+    // Returns true when machine is in one of those states.
+    template <typename... States>
+    bool waitForState(boost::asio::yield_context yield,
+                      std::chrono::steady_clock::duration timeout)
+    {
+        const auto inState = [this]() {
+            return (std::holds_alternative<States>(state) || ...);
+        };
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!inState())
+        {
+            auto waiter =
+                std::make_shared<boost::asio::steady_timer>(ioc.get(), deadline);
+            transitionWaiters.push_back(waiter);
+
+            // Cancellation means transition happened, otherwise time is up
+            boost::system::error_code ec;
+            waiter->async_wait(yield[ec]);
+            if (ec != boost::asio::error::operation_aborted)
+            {
+                return inState();
+            }
+        }
+        return true;
+    }
+
+    void accountStateTime(const std::string& previousState)
+    {
+        const std::string stateName = std::visit(
+            [](const BasicState& state) { return state.stateName; }, state);
+        if (stateName == previousState)
+        {
+            return;
+        }
+        TraceRing::instance().record(
+            TraceRing::Kind::state, name,
+            std::visit([](const BasicState& state) { return state.stateName; },
+                       state));
+        const auto now = std::chrono::steady_clock::now();
+        stateTimeMs[previousState] += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - stateEntered)
+                .count());
+        stateEntered = now;
+    }
+
+    void publishMetrics()
+    {
+        uint64_t bytesRead = ioMetrics.bytesRead;
+        uint64_t bytesWritten = ioMetrics.bytesWritten;
+        uint64_t readRequests = ioMetrics.readRequests;
+        uint64_t writeRequests = ioMetrics.writeRequests;
+        uint64_t latencyAvg = ioMetrics.latency.averageUs();
+
+        // I/O not going through builtin server is only visible on the device
+        const bool builtin = target && target->nbdServer;
+        if (!builtin && config.nbdDevice &&
+            !std::holds_alternative<ReadyState>(state))
+        {
+            auto current = BlockDeviceStats::read(config.nbdDevice.sysfsPath());
+            if (current)
+            {
+                if (!deviceBaseline)
+                {
+                    deviceBaseline = current;
+                }
+                const auto stats = *current - *deviceBaseline;
+                bytesRead = stats.readSectors * 512;
+                bytesWritten = stats.writeSectors * 512;
+                readRequests = stats.readRequests;
+                writeRequests = stats.writeRequests;
+                const uint64_t requests = readRequests + writeRequests;
+                latencyAvg =
+                    requests ? (stats.readTicksMs + stats.writeTicksMs) * 1000 /
+                                   requests
+                             : 0;
+            }
+        }
+
+        const uint64_t lookups = cacheStats.hits + cacheStats.misses;
+        Metrics next;
+        next.bytesRead = bytesRead;
+        next.bytesWritten = bytesWritten;
+        next.readRequests = readRequests;
+        next.writeRequests = writeRequests;
+        next.latencyAvgUs = latencyAvg;
+        next.latencyP50Us = ioMetrics.latency.percentile(50);
+        next.latencyP99Us = ioMetrics.latency.percentile(99);
+        next.cacheHitRate = lookups ? double(cacheStats.hits) / lookups : 0.0;
+        next.stateTimeMs = stateTimeMs;
+        // Requests held back by I/O scheduler or bandwidth limit
+        next.queueDepth = ioFlow ? ioFlow->queueDepth() : 0;
+        next.throttled = ioFlow && ioFlow->throttled();
+
+        std::vector<const char*> changes;
+        const auto compare = [&changes](const char* name, const auto& current,
+                                        const auto& previous) {
+            if (current != previous)
+            {
+                changes.push_back(name);
+            }
+        };
+        compare("BytesRead", next.bytesRead, metrics.bytesRead);
+        compare("BytesWritten", next.bytesWritten, metrics.bytesWritten);
+        compare("ReadRequests", next.readRequests, metrics.readRequests);
+        compare("WriteRequests", next.writeRequests, metrics.writeRequests);
+        compare("LatencyAvgUs", next.latencyAvgUs, metrics.latencyAvgUs);
+        compare("LatencyP50Us", next.latencyP50Us, metrics.latencyP50Us);
+        compare("LatencyP99Us", next.latencyP99Us, metrics.latencyP99Us);
+        compare("CacheHitRate", next.cacheHitRate, metrics.cacheHitRate);
+        compare("StateTimeMs", next.stateTimeMs, metrics.stateTimeMs);
+        compare("QueueDepth", next.queueDepth, metrics.queueDepth);
+        compare("Throttled", next.throttled, metrics.throttled);
+        metrics = std::move(next);
+        if (!changes.empty())
+        {
+            emitPropertiesChanged(getObjectPath() + name,
+                                  "xyz.openbmc_project.VirtualMedia.Metrics",
+                                  std::move(changes));
+        }
+
+        trackActivity(readRequests + writeRequests);
+    }
+
+    // Active image is ejected once InactivityTimeout passes without any
+    // request completed by the device
+    void trackActivity(uint64_t requests)
+    {
+        if (config.inactivityTimeout.count() == 0 ||
+            !std::holds_alternative<ActiveState>(state))
+        {
+            lastActivity.reset();
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (!lastActivity || requests != activityRequests)
+        {
+            lastActivity = now;
+            activityRequests = requests;
+            return;
+        }
+        if (now - *lastActivity >= config.inactivityTimeout)
+        {
+            LogMsg(Logger::Info, name, " inactive for ",
+                   config.inactivityTimeout.count(), "s, unmounting");
+            lastActivity.reset();
+            emitUnmountEvent();
+        }
+    }
+
+    // Writes of read-write mount go to local overlay, image stays intact
+    bool overlayed() const
+    {
+        return target && target->rw && config.overlayDirectory &&
+               config.mode == Configuration::Mode::legacy;
+    }
+
+    // Zero when image is not active or it never times out
+    uint64_t remainingInactivitySeconds() const
+    {
+        if (!lastActivity)
+        {
+            return 0;
+        }
+        const auto idle = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - *lastActivity);
+        return idle < config.inactivityTimeout
+                   ? static_cast<uint64_t>(
+                         (config.inactivityTimeout - idle).count())
+                   : 0;
+    }
+
+    // Changed properties of each interface are announced with single
+    // PropertiesChanged signal
+    void refreshProperties()
+    {
+        Properties next;
+        next.active = std::holds_alternative<ActiveState>(state);
+        if (target)
+        {
+            next.writeProtected = !target->rw;
+            if (next.active)
+            {
+                next.imageUrl = target->imgUrl;
+                next.user = target->user;
+            }
+        }
+        next.cdrom = next.active && cdrom.value_or(false);
+
+        std::vector<const char*> mountPointChanges;
+        if (next.imageUrl != properties.imageUrl)
+        {
+            mountPointChanges.push_back("ImageURL");
+        }
+        if (next.user != properties.user)
+        {
+            mountPointChanges.push_back("User");
+        }
+        if (next.writeProtected != properties.writeProtected)
+        {
+            mountPointChanges.push_back("WriteProtected");
+        }
+        if (next.cdrom != properties.cdrom)
+        {
+            mountPointChanges.push_back("Cdrom");
+        }
+        const bool activeChanged = next.active != properties.active;
+        properties = std::move(next);
+
+        const std::string path = getObjectPath() + name;
+        if (!mountPointChanges.empty())
+        {
+            emitPropertiesChanged(path,
+                                  "xyz.openbmc_project.VirtualMedia.MountPoint",
+                                  std::move(mountPointChanges));
+        }
+        if (activeChanged)
+        {
+            emitPropertiesChanged(path, "xyz.openbmc_project.VirtualMedia.Process",
+                                  {"Active"});
+        }
+    }
+
+    void emitPropertiesChanged(const std::string& path, const char* interface,
+                               std::vector<const char*>&& names)
+    {
+        names.push_back(nullptr);
+        int ret = sd_bus_emit_properties_changed_strv(
+            bus->get(), path.c_str(), interface,
+            const_cast<char**>(names.data()));
+        if (ret < 0)
+        {
+            LogMsg(Logger::Debug, name, " PropertiesChanged failed: ", -ret);
+        }
+    }
+
+    void notifyTransition()
+    {
+        auto waiters = std::move(transitionWaiters);
+        transitionWaiters.clear();
+        for (auto& weakWaiter : waiters)
+        {
+            if (auto waiter = weakWaiter.lock())
+            {
+                waiter->cancel();
+            }
+        }
     }
 
     void emitRegisterDBusEvent(
@@ -1035,21 +1929,54 @@ struct MountPointStateMachine
         emitEvent(ActivationStartedEvent());
     }
 
-    void emitSubprocessStoppedEvent()
+    void emitShareMountedEvent(uint64_t activation,
+                               const std::optional<fs::path>& mountDir,
+                               const fs::path& imageName,
+                               std::optional<bool> iso)
     {
-        emitEvent(SubprocessStoppedEvent());
+        // Activation could have been cancelled while share was being mounted
+        if (activation != activationId ||
+            !std::holds_alternative<ActivatingState>(state))
+        {
+            LogMsg(Logger::Debug, name, " Ignoring outdated share mount");
+            if (mountDir)
+            {
+                smbShares.release(*mountDir);
+            }
+            return;
+        }
+        if (!mountDir)
+        {
+            emitEvent(ShareMountFailedEvent());
+            return;
+        }
+        // From now on ReadyState takes care of releasing the share
+        target->mountDir = *mountDir;
+        cdrom = iso;
+        emitEvent(ShareMountedEvent(*mountDir, imageName));
     }
 
-    void emitUdevStateChangeEvent(const NBDDevice& dev, StateChange devState)
+    void emitMediumProbedEvent(uint64_t activation, bool iso)
     {
-        if (config.nbdDevice == dev)
-        {
-            emitEvent(UdevStateChangeEvent(devState));
-        }
-        else
+        if (activation != activationId ||
+            !std::holds_alternative<WaitingForGadgetState>(state))
         {
-            LogMsg(Logger::Debug, name, " Ignoring request.");
+            LogMsg(Logger::Debug, name, " Ignoring outdated medium probe");
+            return;
         }
+        LogMsg(Logger::Info, name, " Medium is ", iso ? "CD-ROM" : "disk");
+        cdrom = iso;
+        emitEvent(MediumProbedEvent());
+    }
+
+    void emitSubprocessStoppedEvent()
+    {
+        emitEvent(SubprocessStoppedEvent());
+    }
+
+    void emitUdevStateChangeEvent(StateChange devState)
+    {
+        emitEvent(UdevStateChangeEvent(devState));
     }
 
     struct Target
@@ -1058,15 +1985,74 @@ struct MountPointStateMachine
         bool rw;
         std::optional<fs::path> mountDir;
         std::unique_ptr<utils::CredentialsProvider> credentials;
+        std::string user;
+        std::shared_ptr<nbd::Server> nbdServer;
+    };
+
+    // Values served by Metrics interface getters, refreshed every
+    // metricsInterval
+    struct Metrics
+    {
+        uint64_t bytesRead = 0;
+        uint64_t bytesWritten = 0;
+        uint64_t readRequests = 0;
+        uint64_t writeRequests = 0;
+        uint64_t latencyAvgUs = 0;
+        uint64_t latencyP50Us = 0;
+        uint64_t latencyP99Us = 0;
+        double cacheHitRate = 0;
+        std::map<std::string, uint64_t> stateTimeMs;
+        uint32_t queueDepth = 0;
+        bool throttled = false;
+    };
+
+    // Values served by MountPoint and Process interface getters. Rebuilt on
+    // state transitions only, so frequent polling doesn't walk the state.
+    struct Properties
+    {
+        bool active = false;
+        std::string imageUrl;
+        std::string user;
+        bool writeProtected = true;
+        bool cdrom = false;
     };
 
     std::reference_wrapper<boost::asio::io_context> ioc;
+    DeviceMonitor& devMonitor;
+    VhubPortAllocator& ports;
+    NBDDeviceAllocator& nbdDevices;
+    WorkerPool& workers;
+    SmbShareManager& smbShares;
+    uint64_t activationId = 0;
     std::string name;
     Configuration::MountPoint config;
 
     std::optional<Target> target;
+    Properties properties;
+    Metrics metrics;
+    // Batching relay in front of the proxy, Proxy mode only
+    std::shared_ptr<ProxyRelay> proxyRelay;
+    // Active session is left running on exit, see session_journal.hpp
+    bool journaled = false;
+    // Medium is ISO image, unknown until probed
+    std::optional<bool> cdrom;
+    // Scheduling of built-in server I/O, when enabled
+    std::shared_ptr<nbd::IoScheduler::Flow> ioFlow;
     State state;
     int exitCode;
+    nbd::CacheStats cacheStats;
+    IoMetrics ioMetrics;
+    // Device counters at the beginning of mount, when not served by daemon
+    std::optional<BlockDeviceStats> deviceBaseline;
+    // Request count seen at last I/O activity, for InactivityTimeout
+    uint64_t activityRequests = 0;
+    std::optional<std::chrono::steady_clock::time_point> lastActivity;
+    // Time spent in states already left
+    std::map<std::string, uint64_t> stateTimeMs;
+    std::chrono::steady_clock::time_point stateEntered =
+        std::chrono::steady_clock::now();
+    static constexpr const std::chrono::seconds metricsInterval{1};
+    std::vector<std::weak_ptr<boost::asio::steady_timer>> transitionWaiters;
     const std::string proxyObjectPath = "/xyz/openbmc_project/VirtualMedia/Proxy/";
     const std::string legacyObjectPath = "/xyz/openbmc_project/VirtualMedia/Legacy/";
     std::shared_ptr<sdbusplus::asio::connection>& bus;
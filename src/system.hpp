@@ -1,16 +1,34 @@
 #pragma once
 
+#include "configfs.hpp"
 #include "logger.hpp"
+#include "vhub_ports.hpp"
 
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/container/flat_map.hpp>
+#include <boost/container/flat_set.hpp>
 #include <boost/process.hpp>
 #include <sdbusplus/asio/object_server.hpp>
 
+#include <poll.h>
+#include <sys/syscall.h>
+
 #include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
 
 namespace fs = std::filesystem;
 
@@ -52,36 +70,26 @@ struct deviceDeleter
 class NBDDevice
 {
   public:
-    enum Value : uint8_t // This is explicite not a class to avoid naming like
-                         // NBDDevice::Device::nbd0
-    {
-        nbd0 = 0,
-        nbd1 = 1,
-        nbd2 = 2,
-        nbd3 = 3,
-        nbd4 = 4,
-        nbd5 = 5,
-        nbd6 = 6,
-        nbd7 = 7,
-        nbd8 = 8,
-        nbd9 = 9,
-        nbd10 = 10,
-        unknown = 0xFF
-    };
+    static constexpr const uint32_t unknown = UINT32_MAX;
 
     NBDDevice() = default;
-    NBDDevice(Value v) : value(v){};
+    explicit NBDDevice(uint32_t index) : index(index){};
+    // Accepts "nbdN" names, parsed in place without any lookup table
     explicit NBDDevice(const char* nbdName)
     {
-        if (nbdName != nullptr)
+        if (nbdName == nullptr || std::strncmp(nbdName, "nbd", 3) != 0)
         {
-            const auto iter =
-                std::find(nameMatching.cbegin(), nameMatching.cend(), nbdName);
-            if (iter != nameMatching.cend())
-            {
-                value = static_cast<Value>(
-                    std::distance(nameMatching.cbegin(), iter));
-            }
+            return;
+        }
+        const char* begin = nbdName + 3;
+        const char* end = begin + std::strlen(begin);
+        uint32_t parsed = 0;
+        auto [ptr, ec] = std::from_chars(begin, end, parsed);
+        // Partitions (nbd0p1) and leading zeros are not devices
+        if (ec == std::errc() && ptr == end && begin != end &&
+            (*begin != '0' || end - begin == 1) && parsed != unknown)
+        {
+            index = parsed;
         }
     }
     NBDDevice(const NBDDevice&) = default;
@@ -92,24 +100,29 @@ class NBDDevice
 
     bool operator==(const NBDDevice& rhs) const
     {
-        return value == rhs.value;
+        return index == rhs.index;
     }
     bool operator!=(const NBDDevice& rhs) const
     {
-        return value != rhs.value;
+        return index != rhs.index;
     }
     bool operator<(const NBDDevice& rhs) const
     {
-        return value < rhs.value;
+        return index < rhs.index;
+    }
+    explicit operator bool() const
+    {
+        return (index != unknown);
     }
-    explicit operator bool()
+
+    uint32_t id() const
     {
-        return (value != unknown);
+        return index;
     }
 
     bool isReady() const
     {
-        if (value == unknown)
+        if (index == unknown)
         {
             return false;
         }
@@ -122,9 +135,16 @@ class NBDDevice
         return true;
     }
 
+    // Device has NBD connection configured (pid attribute exists only then)
+    bool isConnected() const
+    {
+        std::error_code ec;
+        return index != unknown && fs::exists(sysfsPath() / "pid", ec);
+    }
+
     void disconnect() const
     {
-        if (value == unknown)
+        if (index == unknown)
         {
             return;
         }
@@ -149,29 +169,96 @@ class NBDDevice
 
     std::string to_string() const
     {
-        if (value == unknown)
+        if (index == unknown)
         {
             return "";
         }
-        return nameMatching[static_cast<uint8_t>(value)];
+        return "nbd" + std::to_string(index);
     }
 
     fs::path to_path() const
     {
-        if (value == unknown)
+        if (index == unknown)
+        {
+            return fs::path();
+        }
+        return fs::path("/dev") / to_string();
+    }
+
+    fs::path sysfsPath() const
+    {
+        if (index == unknown)
         {
             return fs::path();
         }
-        return fs::path("/dev") /
-               fs::path(nameMatching[static_cast<uint8_t>(value)]);
+        return fs::path("/sys/block") / to_string();
     }
 
   private:
-    Value value = unknown;
+    uint32_t index = unknown;
+};
+
+// Hands out NBD devices to mount points not bound to particular device in
+// configuration. Free device is one existing in /sys/block, not bound in
+// configuration, not handed out already and without NBD connection.
+class NBDDeviceAllocator
+{
+  public:
+    void reserve(const NBDDevice& device)
+    {
+        reserved.insert(device);
+    }
+
+    std::optional<NBDDevice> allocate()
+    {
+        const auto devices = freeDevices();
+        if (devices.empty())
+        {
+            LogMsg(Logger::Error, "[NBDDeviceAllocator]: No free NBD device");
+            return {};
+        }
+        allocated.insert(devices.front());
+        LogMsg(Logger::Debug, "[NBDDeviceAllocator]: ",
+               devices.front().to_string(), " allocated");
+        return devices.front();
+    }
+
+    // Device left connected by previous instance of the daemon
+    void claim(const NBDDevice& device)
+    {
+        allocated.insert(device);
+    }
+
+    void release(const NBDDevice& device)
+    {
+        if (allocated.erase(device))
+        {
+            LogMsg(Logger::Debug, "[NBDDeviceAllocator]: ", device.to_string(),
+                   " released");
+        }
+    }
+
+    // Sorted by index, so lowest devices are used first
+    std::vector<NBDDevice> freeDevices() const
+    {
+        std::vector<NBDDevice> devices;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator("/sys/block", ec))
+        {
+            NBDDevice device(entry.path().filename().c_str());
+            if (device && !reserved.count(device) && !allocated.count(device) &&
+                !device.isConnected())
+            {
+                devices.push_back(device);
+            }
+        }
+        std::sort(devices.begin(), devices.end());
+        return devices;
+    }
 
-    static const inline std::vector<std::string> nameMatching = {
-        "nbd0", "nbd1", "nbd2", "nbd3", "nbd4", "nbd5",
-        "nbd6", "nbd7", "nbd8", "nbd9", "nbd10"};
+  private:
+    boost::container::flat_set<NBDDevice> reserved;
+    boost::container::flat_set<NBDDevice> allocated;
 };
 
 enum class StateChange
@@ -205,6 +292,13 @@ class DeviceMonitor
         int rc = udev_monitor_filter_add_match_subsystem_devtype(
             monitor.get(), "block", "disk");
 
+        if (rc == 0)
+        {
+            // Gadget bind/unbind, keeps vhub port allocator up to date
+            rc = udev_monitor_filter_add_match_subsystem_devtype(
+                monitor.get(), "udc", nullptr);
+        }
+
         if (rc)
         {
             throw std::system_error(EFAULT, std::generic_category(),
@@ -225,126 +319,199 @@ class DeviceMonitor
     DeviceMonitor& operator=(const DeviceMonitor&) = delete;
     DeviceMonitor& operator=(DeviceMonitor&&) = delete;
 
-    template <typename DeviceChangeStateCb>
-    void run(DeviceChangeStateCb callback)
+    // Callback receives UDC name and name of gadget driver bound to it
+    void onUdcChange(
+        std::function<void(const std::string&, const std::string&)> callback)
+    {
+        udcCallback = std::move(callback);
+    }
+
+    // Every watched device has single handler, its owner. Events are
+    // dispatched by device index, nothing is allocated per event.
+    using Handler = std::function<void(StateChange)>;
+
+    void run()
     {
-        boost::asio::spawn(ioc, [this,
-                                 callback](boost::asio::yield_context yield) {
+        boost::asio::spawn(ioc, [this](boost::asio::yield_context yield) {
             boost::system::error_code ec;
             while (1)
             {
                 monitorSd.async_wait(
                     boost::asio::posix::stream_descriptor::wait_read,
                     yield[ec]);
-
-                std::unique_ptr<udev::udev_device, udev::deviceDeleter> device =
-                    std::unique_ptr<udev::udev_device, udev::deviceDeleter>(
-                        udev::udev_monitor_receive_device(monitor.get()));
-                if (device)
+                if (ec == boost::asio::error::operation_aborted)
                 {
-                    const char* devAction =
-                        udev_device_get_action(device.get());
-                    if (devAction == nullptr)
-                    {
-                        LogMsg(Logger::Error,
-                               "[DeviceMonitor]: Received NULL action.");
-                        continue;
-                    }
-                    if (strcmp(devAction, "change") != 0)
-                    {
-                        continue;
-                    }
-
-                    const char* sysname = udev_device_get_sysname(device.get());
-                    if (sysname == nullptr)
-                    {
-                        LogMsg(Logger::Error,
-                               "[DeviceMonitor]: Received NULL sysname.");
-                        continue;
-                    }
-
-                    NBDDevice nbdDevice(sysname);
-                    if (!nbdDevice)
-                    {
-                        continue;
-                    }
-
-                    auto monitoredDevice = devices.find(nbdDevice);
-                    if (monitoredDevice == devices.cend())
-                    {
-                        continue;
-                    }
-
-                    const char* sizeStr =
-                        udev_device_get_sysattr_value(device.get(), "size");
-                    if (sizeStr == nullptr)
-                    {
-                        LogMsg(Logger::Error,
-                               "[DeviceMonitor]: Received NULL size.");
-                        continue;
-                    }
+                    return;
+                }
 
-                    uint64_t size = 0;
-                    try
-                    {
-                        size = std::stoul(sizeStr, 0, 0);
-                    }
-                    catch (const std::exception& e)
-                    {
-                        LogMsg(Logger::Error,
-                               "[DeviceMonitor]: Could not convert "
-                               "size "
-                               "to integer.");
-                        continue;
-                    }
-                    if (size > 0 &&
-                        monitoredDevice->second != StateChange::inserted)
-                    {
-                        LogMsg(Logger::Info,
-                               "[DeviceMonitor]: ", nbdDevice.to_path(),
-                               " inserted.");
-                        monitoredDevice->second = StateChange::inserted;
-                        callback(nbdDevice, StateChange::inserted);
-                    }
-                    else if (size == 0 &&
-                             monitoredDevice->second != StateChange::removed)
+                // Whole burst is read before anything is dispatched, device
+                // changing several times within it is reported once, with
+                // its final state
+                for (unsigned i = 0; i < maxBurst; i++)
+                {
+                    std::unique_ptr<udev::udev_device, udev::deviceDeleter>
+                        device(udev::udev_monitor_receive_device(monitor.get()));
+                    if (!device)
                     {
-                        LogMsg(Logger::Info,
-                               "[DeviceMonitor]: ", nbdDevice.to_path(),
-                               " removed.");
-                        monitoredDevice->second = StateChange::removed;
-                        callback(nbdDevice, StateChange::removed);
+                        break;
                     }
+                    receive(device.get());
                 }
+                dispatch();
             }
         });
     }
 
-    void addDevice(const NBDDevice& device)
+    void addDevice(const NBDDevice& device, Handler handler)
     {
         LogMsg(Logger::Info, "[DeviceMonitor]: watch on ", device.to_path());
-        devices.insert(
-            std::pair<NBDDevice, StateChange>(device, StateChange::unknown));
+        if (device.id() >= watches.size())
+        {
+            watches.resize(device.id() + 1);
+        }
+        watches[device.id()] = {StateChange::unknown, StateChange::unknown,
+                                std::move(handler)};
+    }
+
+    void removeDevice(const NBDDevice& device)
+    {
+        LogMsg(Logger::Info, "[DeviceMonitor]: stop watching ",
+               device.to_path());
+        if (Watch* watch = find(device))
+        {
+            *watch = Watch();
+        }
     }
 
     StateChange getState(const NBDDevice& device)
     {
-        auto monitoredDevice = devices.find(device);
-        if (monitoredDevice != devices.cend())
+        if (Watch* watch = find(device))
         {
-            return monitoredDevice->second;
+            return watch->state;
         }
         return StateChange::notMonitored;
     }
 
   private:
+    static constexpr const unsigned maxBurst = 64;
+
+    struct Watch
+    {
+        // Last state reported to handler
+        StateChange state = StateChange::notMonitored;
+        // Last state seen in current burst
+        StateChange seen = StateChange::notMonitored;
+        Handler handler;
+    };
+
+    Watch* find(const NBDDevice& device)
+    {
+        if (!device || device.id() >= watches.size() ||
+            watches[device.id()].state == StateChange::notMonitored)
+        {
+            return nullptr;
+        }
+        return &watches[device.id()];
+    }
+
+    // Kernel netlink source carries no udev tags and monitor filters can't
+    // match sysname, so unrelated block devices are rejected here by the
+    // name, before any attribute is read
+    void receive(udev::udev_device* device)
+    {
+        const char* devAction = udev_device_get_action(device);
+        if (devAction == nullptr)
+        {
+            LogMsg(Logger::Error, "[DeviceMonitor]: Received NULL action.");
+            return;
+        }
+        if (strcmp(devAction, "change") != 0)
+        {
+            return;
+        }
+
+        const char* sysname = udev_device_get_sysname(device);
+        if (sysname == nullptr)
+        {
+            LogMsg(Logger::Error, "[DeviceMonitor]: Received NULL sysname.");
+            return;
+        }
+
+        const char* subsystem = udev_device_get_subsystem(device);
+        if (subsystem && strcmp(subsystem, "udc") == 0)
+        {
+            if (udcCallback)
+            {
+                const char* function =
+                    udev_device_get_sysattr_value(device, "function");
+                udcCallback(sysname, function ? function : "");
+            }
+            return;
+        }
+
+        const NBDDevice nbdDevice(sysname);
+        Watch* watch = find(nbdDevice);
+        if (watch == nullptr)
+        {
+            return;
+        }
+
+        const char* sizeStr = udev_device_get_sysattr_value(device, "size");
+        if (sizeStr == nullptr)
+        {
+            LogMsg(Logger::Error, "[DeviceMonitor]: Received NULL size.");
+            return;
+        }
+        uint64_t size = 0;
+        const char* sizeEnd = sizeStr + std::strlen(sizeStr);
+        auto [ptr, ec] = std::from_chars(sizeStr, sizeEnd, size);
+        if (ec != std::errc() || ptr == sizeStr)
+        {
+            LogMsg(Logger::Error, "[DeviceMonitor]: Could not convert size "
+                                  "to integer.");
+            return;
+        }
+        watch->seen = size > 0 ? StateChange::inserted : StateChange::removed;
+        if (watch->seen != watch->state)
+        {
+            pending.push_back(nbdDevice);
+        }
+    }
+
+    void dispatch()
+    {
+        // Handlers may add or remove watches, vector is reused between
+        // bursts
+        std::swap(pending, dispatching);
+        for (const NBDDevice& device : dispatching)
+        {
+            Watch* watch = find(device);
+            if (watch == nullptr || watch->seen == watch->state)
+            {
+                continue;
+            }
+            const StateChange change = watch->seen;
+            watch->state = change;
+            LogMsg(Logger::Info, "[DeviceMonitor]: ", device.to_path(),
+                   change == StateChange::inserted ? " inserted."
+                                                   : " removed.");
+            // Owner may stop watching from within the handler
+            Handler handler = watch->handler;
+            handler(change);
+        }
+        dispatching.clear();
+    }
+
     boost::asio::io_context& ioc;
     boost::asio::posix::stream_descriptor monitorSd;
 
     std::unique_ptr<udev::udev, udev::udevDeleter> udev;
     std::unique_ptr<udev::udev_monitor, udev::monitorDeleter> monitor;
 
-    boost::container::flat_map<NBDDevice, StateChange> devices;
+    std::vector<Watch> watches;
+    std::vector<NBDDevice> pending;
+    std::vector<NBDDevice> dispatching;
+    std::function<void(const std::string&, const std::string&)> udcCallback;
 };
 
 class Process : public std::enable_shared_from_this<Process>
@@ -356,6 +523,14 @@ class Process : public std::enable_shared_from_this<Process>
         pipe(ioc), name(name), app(app), dev(dev)
     {}
 
+    ~Process()
+    {
+        if (adopted >= 0)
+        {
+            ::close(adopted);
+        }
+    }
+
     template <typename ExitCb>
     bool spawn(const std::vector<std::string>& args, ExitCb&& onExit)
     {
@@ -410,18 +585,9 @@ class Process : public std::enable_shared_from_this<Process>
                 // The process shall be dead, or almost here, give it a chance
                 LogMsg(Logger::Debug,
                        "[Process]: Waiting process to finish normally");
-                boost::asio::steady_timer timer(ioc);
-                int32_t waitCnt = 20;
-                while (child.running() && waitCnt > 0)
+                if (!waitForExit(yield, exitTimeout))
                 {
-                    boost::system::error_code ignored_ec;
-                    timer.expires_from_now(std::chrono::milliseconds(100));
-                    timer.async_wait(yield[ignored_ec]);
-                    waitCnt--;
-                }
-                if (child.running())
-                {
-                    child.terminate();
+                    terminate();
                 }
 
                 child.wait();
@@ -442,36 +608,162 @@ class Process : public std::enable_shared_from_this<Process>
             dev.disconnect();
 
             // The Ugly (but required)
-            boost::asio::steady_timer timer(ioc);
-            int32_t waitCnt = 20;
-            while (child.running() && waitCnt > 0)
-            {
-                boost::system::error_code ignored_ec;
-                timer.expires_from_now(std::chrono::milliseconds(100));
-                timer.async_wait(yield[ignored_ec]);
-                waitCnt--;
-            }
-            if (child.running())
+            if (!waitForExit(yield, exitTimeout))
             {
                 LogMsg(Logger::Info, "[Process] Terminate if process doesnt "
                                      "want to exit nicely");
-                child.terminate();
+                terminate();
             }
         });
     }
 
+    // Takes over process left running by previous instance of the daemon.
+    // It is not our child, so only its exit is observed and exit code is
+    // unknown to onExit.
+    template <typename ExitCb>
+    bool adopt(pid_t pid, ExitCb&& onExit)
+    {
+        int fd = static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+        if (fd < 0)
+        {
+            LogMsg(Logger::Info, "[Process]: (", name, ") Process ", pid,
+                   " is gone, errno = ", errno);
+            return false;
+        }
+        // Checked after pidfd is held, pid cannot be reused meanwhile
+        std::error_code ec;
+        const fs::path exe =
+            fs::read_symlink("/proc/" + std::to_string(pid) + "/exe", ec);
+        if (ec || exe != app)
+        {
+            LogMsg(Logger::Info, "[Process]: (", name, ") Process ", pid,
+                   " is not ", app);
+            ::close(fd);
+            return false;
+        }
+        adopted = fd;
+        adoptedPid = pid;
+        LogMsg(Logger::Info, "[Process]: (", name, ") Adopted ", app, " (",
+               pid, ")");
+
+        boost::asio::spawn(
+            ioc, [this, self = shared_from_this(),
+                  onExit{std::move(onExit)}](boost::asio::yield_context yield) {
+                boost::asio::posix::stream_descriptor pidfd(ioc,
+                                                            ::dup(adopted));
+                boost::system::error_code ignored_ec;
+                pidfd.async_wait(
+                    boost::asio::posix::stream_descriptor::wait_read,
+                    yield[ignored_ec]);
+                LogMsg(Logger::Info, "[Process]: (", name, ") Adopted ", app,
+                       " exited");
+                onExit(-1, dev.isReady());
+            });
+        return true;
+    }
+
+    // Leaves child running when the daemon exits, see session_journal.hpp
+    void release()
+    {
+        if (adopted < 0 && child.valid())
+        {
+            child.detach();
+        }
+    }
+
+    pid_t pid()
+    {
+        return adopted >= 0 ? adoptedPid : child.id();
+    }
+
     std::string application()
     {
         return app;
     }
 
   private:
+    static constexpr const std::chrono::seconds exitTimeout{2};
+
+    // Suspends until child exits or timeout passes, returns true if child is
+    // not running anymore. Exit is signalled through pidfd, polling is used
+    // only on kernels not supporting it.
+    bool waitForExit(boost::asio::yield_context yield,
+                     std::chrono::steady_clock::duration timeout)
+    {
+        if (!running())
+        {
+            return true;
+        }
+
+        boost::asio::steady_timer timer(ioc, timeout);
+        int fd = adopted >= 0
+                     ? ::dup(adopted)
+                     : static_cast<int>(
+                           ::syscall(SYS_pidfd_open, child.id(), 0));
+        if (fd < 0)
+        {
+            LogMsg(Logger::Debug, "[Process]: pidfd unavailable, errno = ",
+                   errno);
+            boost::asio::steady_timer poll(ioc);
+            while (running() &&
+                   timer.expiry() > boost::asio::steady_timer::clock_type::now())
+            {
+                boost::system::error_code ignored_ec;
+                poll.expires_after(std::chrono::milliseconds(100));
+                poll.async_wait(yield[ignored_ec]);
+            }
+            return !running();
+        }
+
+        // Timer handler may already be queued when process exits, so it
+        // shares ownership of the descriptor
+        auto pidfd =
+            std::make_shared<boost::asio::posix::stream_descriptor>(ioc, fd);
+        timer.async_wait([pidfd](const boost::system::error_code& ec) {
+            if (!ec)
+            {
+                boost::system::error_code ignored_ec;
+                pidfd->cancel(ignored_ec);
+            }
+        });
+
+        boost::system::error_code ignored_ec;
+        pidfd->async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                          yield[ignored_ec]);
+        timer.cancel();
+        return !running();
+    }
+
+    // Adopted process is not our child, its pidfd becomes readable on exit
+    bool running()
+    {
+        if (adopted >= 0)
+        {
+            pollfd fd{adopted, POLLIN, 0};
+            return ::poll(&fd, 1, 0) == 0;
+        }
+        return child.running();
+    }
+
+    void terminate()
+    {
+        if (adopted >= 0)
+        {
+            ::syscall(SYS_pidfd_send_signal, adopted, SIGKILL, nullptr, 0);
+            return;
+        }
+        child.terminate();
+    }
+
     boost::asio::io_context& ioc;
     boost::process::child child;
     boost::process::async_pipe pipe;
     std::string name;
     std::string app;
-    const NBDDevice& dev;
+    // Copy, slot may be handed another device while process is stopping
+    const NBDDevice dev;
+    int adopted = -1;
+    pid_t adoptedPid = 0;
 };
 
 class FsHelper
@@ -489,22 +781,23 @@ class FsHelper
     }
 };
 
-struct UsbGadget : private FsHelper
+struct UsbGadget
 {
   public:
-    static int32_t configure(const std::string& name, const NBDDevice& nbd,
-                             StateChange change, const bool rw = false)
+    static int32_t configure(VhubPortAllocator& ports, const std::string& name,
+                             const NBDDevice& nbd, StateChange change,
+                             const bool rw = false, const bool cdrom = false)
     {
-        return configure(name, nbd.to_path(), change, rw);
+        return configure(ports, name, nbd.to_path(), change, rw, cdrom);
     }
 
-    static int32_t configure(const std::string& name, const fs::path& path,
-                             StateChange change, const bool rw = false)
+    // CD-ROM LUN is always read-only and uses 2048 byte blocks towards host
+    static int32_t configure(VhubPortAllocator& ports, const std::string& name,
+                             const fs::path& path, StateChange change,
+                             const bool rw = false, const bool cdrom = false)
     {
         LogMsg(Logger::Info, "[App]: Configure USB Gadget (name=", name,
                ", path=", path, ", State=", static_cast<uint32_t>(change), ")");
-        bool success = true;
-        std::error_code ec;
         if (change == StateChange::unknown)
         {
             LogMsg(Logger::Critical,
@@ -512,121 +805,464 @@ struct UsbGadget : private FsHelper
             return -1;
         }
 
-        const fs::path gadgetDir =
-            "/sys/kernel/config/usb_gadget/mass-storage-" + name;
-        const fs::path funcMassStorageDir =
-            gadgetDir / "functions/mass_storage.usb0";
-        const fs::path stringsDir = gadgetDir / "strings/0x409";
-        const fs::path configDir = gadgetDir / "configs/c.1";
-        const fs::path massStorageDir = configDir / "mass_storage.usb0";
-        const fs::path configStringsDir = configDir / "strings/0x409";
+        const Paths paths(name);
+        if (change != StateChange::inserted)
+        {
+            // StateChange: unknown, notMonitored, inserted were handler
+            // earlier. We'll get here only for removed, or cleanup
+            return teardown(ports, paths) ? 0 : -1;
+        }
+
+        // Leftover of previous run would make symlink creation fail
+        std::error_code ec;
+        if (fs::exists(paths.gadgetDir, ec))
+        {
+            teardown(ports, paths);
+        }
+
+        configfs::Transaction transaction;
+        createSkeleton(transaction, paths);
+        transaction.write(paths.funcMassStorageDir / "lun.0/cdrom",
+                          cdrom ? "1" : "0");
+        transaction.write(paths.funcMassStorageDir / "lun.0/ro", rw ? "0" : "1");
+        transaction.write(paths.funcMassStorageDir / "lun.0/file", path);
+        if (transaction.lastError())
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ",
+                   *transaction.lastError());
+            return -1;
+        }
+
+        const auto port = ports.acquire();
+        if (!port)
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: No free vhub port");
+            return -1;
+        }
+        LogMsg(Logger::Debug, "Use port : ", *port);
+        if (!transaction.write(paths.gadgetDir / "UDC", *port))
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ",
+                   *transaction.lastError());
+            ports.release(*port);
+            return -1;
+        }
+
+        transaction.commit();
+        return 0;
+    }
+
+    // Builds whole gadget except for the medium and UDC binding, so later
+    // insertion takes only a few attribute writes (see attach/detach)
+    static bool provision(VhubPortAllocator& ports, const std::string& name)
+    {
+        LogMsg(Logger::Info, "[App]: Provision USB Gadget (name=", name, ")");
+        const Paths paths(name);
+        std::error_code ec;
+        if (fs::exists(paths.gadgetDir, ec))
+        {
+            teardown(ports, paths);
+        }
 
-        if (change == StateChange::inserted)
+        configfs::Transaction transaction;
+        if (!createSkeleton(transaction, paths))
         {
-            try
+            LogMsg(Logger::Error, "[App]: UsbGadget: ",
+                   *transaction.lastError());
+            return false;
+        }
+        transaction.commit();
+        return true;
+    }
+
+    // Inserts medium into provisioned gadget and binds it to free port
+    static int32_t attach(VhubPortAllocator& ports, const std::string& name,
+                          const fs::path& path, const bool rw = false,
+                          const bool cdrom = false)
+    {
+        LogMsg(Logger::Info, "[App]: Attach USB Gadget (name=", name,
+               ", path=", path, ")");
+        const Paths paths(name);
+        std::error_code ec;
+        if (!fs::exists(paths.gadgetDir, ec) && !provision(ports, name))
+        {
+            return -1;
+        }
+
+        const fs::path lunDir = paths.funcMassStorageDir / "lun.0";
+        auto error = writeLunType(lunDir, rw, cdrom);
+        if (!error)
+        {
+            error = configfs::write(lunDir / "file", path);
+        }
+        if (error)
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
+            return -1;
+        }
+
+        const auto port = ports.acquire();
+        if (!port)
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: No free vhub port");
+            ejectMedium(lunDir);
+            return -1;
+        }
+        LogMsg(Logger::Debug, "Use port : ", *port);
+        if (auto error = configfs::write(paths.gadgetDir / "UDC", *port))
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
+            ports.release(*port);
+            ejectMedium(lunDir);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Unbinds gadget and removes medium, gadget itself stays provisioned
+    static int32_t detach(VhubPortAllocator& ports, const std::string& name)
+    {
+        LogMsg(Logger::Info, "[App]: Detach USB Gadget (name=", name, ")");
+        const Paths paths(name);
+        bool success = true;
+
+        if (!unbind(ports, paths))
+        {
+            success = false;
+        }
+        if (!ejectMedium(paths.funcMassStorageDir / "lun.0"))
+        {
+            success = false;
+        }
+        return success ? 0 : -1;
+    }
+
+    // Gadget shared by several mount points, each of them owning one LUN.
+    // Gadget stays bound while any LUN holds a medium, so media of single
+    // LUNs are swapped without the host enumerating the device again.
+    // Bound gadget is kept when some LUN is in use by adopted session (see
+    // session_journal.hpp), media of other LUNs are ejected.
+    static bool provisionShared(VhubPortAllocator& ports,
+                                const std::string& name,
+                                const std::vector<bool>& inUse)
+    {
+        LogMsg(Logger::Info, "[App]: Provision shared USB Gadget (name=", name,
+               ", luns=", inUse.size(), ")");
+        const Paths paths(name);
+        std::error_code ec;
+        if (fs::exists(paths.gadgetDir, ec))
+        {
+            if (!configfs::read(paths.gadgetDir / "UDC").empty() &&
+                std::find(inUse.begin(), inUse.end(), true) != inUse.end())
             {
-                fs::create_directories(gadgetDir);
-                echoToFile(gadgetDir / "idVendor", "0x1d6b");
-                echoToFile(gadgetDir / "idProduct", "0x0104");
-                fs::create_directories(stringsDir);
-                echoToFile(stringsDir / "manufacturer", "OpenBMC");
-                echoToFile(stringsDir / "product", "Virtual Media Device");
-                fs::create_directories(configStringsDir);
-                echoToFile(configStringsDir / "configuration", "config 1");
-                fs::create_directories(funcMassStorageDir);
-                fs::create_directories(funcMassStorageDir / "lun.0");
-                fs::create_directory_symlink(funcMassStorageDir,
-                                             massStorageDir);
-                echoToFile(funcMassStorageDir / "lun.0/removable", "1");
-                echoToFile(funcMassStorageDir / "lun.0/ro", rw ? "0" : "1");
-                echoToFile(funcMassStorageDir / "lun.0/cdrom", "0");
-                echoToFile(funcMassStorageDir / "lun.0/file", path);
-
-                for (const auto& port : fs::directory_iterator(
-                         "/sys/bus/platform/devices/1e6a0000.usb-vhub"))
+                for (unsigned lun = 0; lun < inUse.size(); lun++)
                 {
-                    if (fs::is_directory(port) && !fs::is_symlink(port) &&
-                        !fs::exists(port.path() / "gadget/suspended"))
+                    if (!inUse[lun])
                     {
-                        const std::string portId = port.path().filename();
-                        LogMsg(Logger::Debug,
-                               "Use port : ", port.path().filename());
-                        echoToFile(gadgetDir / "UDC", portId);
-                        return 0;
+                        ejectMedium(paths.lunDir(lun));
                     }
                 }
+                return true;
             }
-            catch (fs::filesystem_error& e)
+            teardown(ports, paths);
+        }
+
+        configfs::Transaction transaction;
+        createSkeleton(transaction, paths);
+        for (unsigned lun = 1; lun < inUse.size(); lun++)
+        {
+            transaction.mkdir(paths.lunDir(lun));
+            transaction.write(paths.lunDir(lun) / "removable", "1");
+            transaction.write(paths.lunDir(lun) / "cdrom", "0");
+        }
+        if (transaction.lastError())
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ",
+                   *transaction.lastError());
+            return false;
+        }
+        transaction.commit();
+        return true;
+    }
+
+    // Inserts medium into LUN of shared gadget, binding the gadget when it
+    // is the first one
+    static int32_t attachLun(VhubPortAllocator& ports, const std::string& name,
+                             unsigned lun, const fs::path& path,
+                             const bool rw = false, const bool cdrom = false)
+    {
+        LogMsg(Logger::Info, "[App]: Attach USB Gadget LUN (name=", name,
+               ", lun=", lun, ", path=", path, ")");
+        const Paths paths(name);
+        const fs::path lunDir = paths.lunDir(lun);
+        auto error = writeLunType(lunDir, rw, cdrom);
+        if (!error)
+        {
+            error = configfs::write(lunDir / "file", path);
+        }
+        if (error)
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
+            return -1;
+        }
+        if (!configfs::read(paths.gadgetDir / "UDC").empty())
+        {
+            // Host sees medium change of already enumerated device
+            return 0;
+        }
+
+        const auto port = ports.acquire();
+        if (!port)
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: No free vhub port");
+            ejectMedium(lunDir);
+            return -1;
+        }
+        LogMsg(Logger::Debug, "Use port : ", *port);
+        if (auto error = configfs::write(paths.gadgetDir / "UDC", *port))
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
+            ports.release(*port);
+            ejectMedium(lunDir);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Removes medium from LUN of shared gadget, the last one unbinds it
+    static int32_t detachLun(VhubPortAllocator& ports, const std::string& name,
+                             unsigned lun)
+    {
+        LogMsg(Logger::Info, "[App]: Detach USB Gadget LUN (name=", name,
+               ", lun=", lun, ")");
+        const Paths paths(name);
+        if (!ejectMedium(paths.lunDir(lun)))
+        {
+            return -1;
+        }
+        for (unsigned other = 0;; other++)
+        {
+            std::error_code ec;
+            if (!fs::exists(paths.lunDir(other), ec))
             {
-                // Got error perform cleanup
-                LogMsg(Logger::Error, "[App]: UsbGadget: ", e.what());
-                success = false;
+                break;
+            }
+            if (!configfs::read(paths.lunDir(other) / "file").empty())
+            {
+                return 0;
+            }
+        }
+        return unbind(ports, paths) ? 0 : -1;
+    }
+
+    // Gadget left bound by previous instance of the daemon, with the medium
+    // still in place
+    static bool isAttached(const std::string& name, unsigned lun,
+                           const fs::path& path)
+    {
+        const Paths paths(name);
+        return !configfs::read(paths.gadgetDir / "UDC").empty() &&
+               configfs::read(paths.lunDir(lun) / "file") == path.string();
+    }
+
+  private:
+    struct Paths
+    {
+        Paths(const std::string& name) :
+            gadgetDir("/sys/kernel/config/usb_gadget/mass-storage-" + name),
+            funcMassStorageDir(gadgetDir / "functions/mass_storage.usb0"),
+            stringsDir(gadgetDir / "strings/0x409"),
+            configDir(gadgetDir / "configs/c.1"),
+            massStorageDir(configDir / "mass_storage.usb0"),
+            configStringsDir(configDir / "strings/0x409")
+        {}
+
+        fs::path lunDir(unsigned lun) const
+        {
+            return funcMassStorageDir / ("lun." + std::to_string(lun));
+        }
+
+        const fs::path gadgetDir;
+        const fs::path funcMassStorageDir;
+        const fs::path stringsDir;
+        const fs::path configDir;
+        const fs::path massStorageDir;
+        const fs::path configStringsDir;
+    };
+
+    static bool createSkeleton(configfs::Transaction& transaction,
+                               const Paths& paths)
+    {
+        transaction.mkdir(paths.gadgetDir);
+        transaction.write(paths.gadgetDir / "idVendor", "0x1d6b");
+        transaction.write(paths.gadgetDir / "idProduct", "0x0104");
+        transaction.mkdir(paths.stringsDir);
+        transaction.write(paths.stringsDir / "manufacturer", "OpenBMC");
+        transaction.write(paths.stringsDir / "product", "Virtual Media Device");
+        transaction.mkdir(paths.configDir);
+        transaction.mkdir(paths.configStringsDir);
+        transaction.write(paths.configStringsDir / "configuration", "config 1");
+        transaction.mkdir(paths.funcMassStorageDir);
+        transaction.symlink(paths.funcMassStorageDir, paths.massStorageDir);
+        transaction.write(paths.funcMassStorageDir / "lun.0/removable", "1");
+        transaction.write(paths.funcMassStorageDir / "lun.0/cdrom", "0");
+        return !transaction.lastError();
+    }
+
+    // Neither flag can be changed while medium is present, setting cdrom
+    // sets read-only flag as well
+    static std::optional<configfs::Error>
+        writeLunType(const fs::path& lunDir, const bool rw, const bool cdrom)
+    {
+        auto error = configfs::write(lunDir / "cdrom", cdrom ? "1" : "0");
+        if (!error)
+        {
+            error = configfs::write(lunDir / "ro", rw ? "0" : "1");
+        }
+        return error;
+    }
+
+    static bool ejectMedium(const fs::path& lunDir)
+    {
+        auto error = configfs::write(lunDir / "file", "");
+        if (error && error->code.value() == EBUSY)
+        {
+            // Host prevents medium removal, force it
+            error = configfs::write(lunDir / "forced_eject", "1");
+        }
+        if (error)
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
+            return false;
+        }
+        return true;
+    }
+
+    // Unbinds gadget from its port and returns the port to allocator
+    static bool unbind(VhubPortAllocator& ports, const Paths& paths)
+    {
+        const std::string port = configfs::read(paths.gadgetDir / "UDC");
+        auto error = configfs::write(paths.gadgetDir / "UDC", "");
+        // ENODEV means gadget was not bound
+        if (error && error->code.value() != ENODEV)
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
+            return false;
+        }
+        if (!port.empty())
+        {
+            ports.release(port);
+        }
+        return true;
+    }
+
+    // Removes gadget tree in reverse order of creation. Unlinking function
+    // from configuration unbinds gadget from UDC. Missing entries are not
+    // treated as error, so it is safe to call on partially removed tree.
+    static bool teardown(VhubPortAllocator& ports, const Paths& paths)
+    {
+        bool success = true;
+        std::error_code ec;
+        if (fs::exists(paths.gadgetDir, ec) && !unbind(ports, paths))
+        {
+            success = false;
+        }
+        if (auto error = configfs::unlink(paths.massStorageDir))
+        {
+            LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
+            success = false;
+        }
+        // LUNs of shared gadget, lun.0 goes away with the function
+        for (unsigned lun = 1;; lun++)
+        {
+            std::error_code ec;
+            if (!fs::exists(paths.lunDir(lun), ec))
+            {
+                break;
             }
-            catch (std::ofstream::failure& e)
+            if (auto error = configfs::rmdir(paths.lunDir(lun)))
             {
-                // Got error perform cleanup
-                LogMsg(Logger::Error, "[App]: UsbGadget: ", e.what());
+                LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
                 success = false;
+                break;
             }
         }
-        // StateChange: unknown, notMonitored, inserted were handler
-        // earlier. We'll get here only for removed, or cleanup
-
-        const std::string gadgetPath =
-            "/sys/kernel/config/usb_gadget/mass-storage-" + name;
-        const std::string removeMassStorageDir =
-            "rm " + gadgetPath + "/configs/c.1/mass_storage.usb0";
-        const std::string removeFuncMassStorageDir =
-            "rmdir " + gadgetPath + "/functions/mass_storage.usb0";
-        const std::string removeConfigStringsDir =
-            "rmdir  " + gadgetPath + "/configs/c.1/strings/0x409";
-        const std::string removeConfigDir =
-            "rmdir  " + gadgetPath + "/configs/c.1";
-        const std::string removeStringsDir =
-            "rmdir  " + gadgetPath + "/strings/0x409";
-        const std::string removeGadgetDir = "rmdir  " + gadgetPath;
-
-        const std::array<const char*, 6> dirs = {
-            removeMassStorageDir.c_str(),   removeFuncMassStorageDir.c_str(),
-            removeConfigStringsDir.c_str(), removeConfigDir.c_str(),
-            removeStringsDir.c_str(),       removeGadgetDir.c_str()};
-
-        for (const char* dir : dirs)
-        {
-            int ret = 0;
-            ret = system(dir);
-            if (ret != 0)
+        for (const fs::path& dir :
+             {paths.funcMassStorageDir, paths.configStringsDir, paths.configDir,
+              paths.stringsDir, paths.gadgetDir})
+        {
+            if (auto error = configfs::rmdir(dir))
             {
+                LogMsg(Logger::Error, "[App]: UsbGadget: ", *error);
                 success = false;
-                LogMsg(Logger::Error,
-                       "[App]: UsbGadget : Can't remove file or directory");
             }
         }
+        return success;
+    }
+};
+
+// Recognizes medium by its content
+struct Medium
+{
+    static constexpr const int cdromBlockSize = 2048;
+
+    // Volume descriptors of ISO 9660 start at sector 16, every one of them
+    // carries "CD001" after its type byte. Reads device, so it may block.
+    static bool isIso(const fs::path& path)
+    {
+        static constexpr const char isoId[] = "CD001";
+        static constexpr const off_t isoIdOffset = 16 * cdromBlockSize + 1;
 
-        if (success)
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
         {
-            return 0;
+            return false;
         }
-        return -1;
+        char id[sizeof(isoId) - 1];
+        const ssize_t ret = ::pread(fd, id, sizeof(id), isoIdOffset);
+        ::close(fd);
+        return ret == static_cast<ssize_t>(sizeof(id)) &&
+               std::memcmp(id, isoId, sizeof(id)) == 0;
     }
 };
 
-class UdevGadget : private FsHelper
+struct BlockQueue : private FsHelper
+{
+  public:
+    // Limits size of requests issued by kernel to the device
+    static bool setMaxSectors(const NBDDevice& nbd, uint32_t maxSectorsKiB)
+    {
+        const fs::path attribute = nbd.sysfsPath() / "queue/max_sectors_kb";
+        try
+        {
+            echoToFile(attribute, std::to_string(maxSectorsKiB));
+        }
+        catch (std::ofstream::failure& e)
+        {
+            LogMsg(Logger::Error, "[App]: BlockQueue: Unable to set ",
+                   attribute, " to ", maxSectorsKiB, ": ", e.what());
+            return false;
+        }
+        return true;
+    }
+};
+
+class UdevGadget
 {
   public:
     // Workaround for HSD18020136609: Can not mount image using Virtual media
     // and CIFS protocol
-    // This force-triggers udev change events for nbd[0-3] devices, which
+    // This force-triggers udev change event for given nbd device, which
     // prevents from disconnection on first mount event after reboot. The actual
     // rootcause is related with kernel changes that occured between 5.10.67 and
     // 5.14.11. This lead will continue to be investigated in order to provide
     // proper fix.
-    static void forceUdevChange()
+    static void forceUdevChange(const NBDDevice& device)
     {
-        std::string changeStr = "change";
-        echoToFile("/sys/block/nbd0/uevent", changeStr);
-        echoToFile("/sys/block/nbd1/uevent", changeStr);
-        echoToFile("/sys/block/nbd2/uevent", changeStr);
-        echoToFile("/sys/block/nbd3/uevent", changeStr);
+        if (auto error =
+                configfs::write(device.sysfsPath() / "uevent", "change"))
+        {
+            LogMsg(Logger::Error, "[App]: UdevGadget: ", *error);
+        }
     }
 };
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+// Fixed-size ring of timestamped state machine events and state entries. All
+// mount points share one ring, so their activity is on common timeline.
+// Recording stores only pointers to static names and never allocates.
+class TraceRing
+{
+  public:
+    static constexpr const size_t capacity = 1024;
+
+    enum class Kind : uint8_t
+    {
+        event,
+        state
+    };
+
+    static TraceRing& instance()
+    {
+        static TraceRing ring;
+        return ring;
+    }
+
+    // Source has to outlive the ring (mount point name), name has to be
+    // string literal (eg. __FUNCTION__)
+    void record(Kind kind, const std::string& source, const char* name)
+    {
+        entries[next % capacity] = {std::chrono::steady_clock::now(), &source,
+                                    name, kind};
+        next++;
+    }
+
+    void clear()
+    {
+        next = 0;
+    }
+
+    // Chrome trace event format, loadable by chrome://tracing and Perfetto.
+    // Each mount point is shown as separate thread, states as slices lasting
+    // until next state was entered and events as instants.
+    std::string dumpChromeTrace() const
+    {
+        const size_t count = std::min<size_t>(next, capacity);
+        const size_t first = next - count;
+        const auto now = std::chrono::steady_clock::now();
+
+        nlohmann::json events = nlohmann::json::array();
+        std::vector<const std::string*> sources;
+        const auto threadId = [&sources, &events](const std::string* source) {
+            for (size_t i = 0; i < sources.size(); i++)
+            {
+                if (sources[i] == source)
+                {
+                    return i + 1;
+                }
+            }
+            sources.push_back(source);
+            events.push_back({{"name", "thread_name"},
+                              {"ph", "M"},
+                              {"pid", 1},
+                              {"tid", sources.size()},
+                              {"args", {{"name", *source}}}});
+            return sources.size();
+        };
+
+        for (size_t i = first; i < next; i++)
+        {
+            const Entry& entry = entries[i % capacity];
+            nlohmann::json event = {{"name", entry.name},
+                                    {"pid", 1},
+                                    {"tid", threadId(entry.source)},
+                                    {"ts", microseconds(entry.time)}};
+            if (entry.kind == Kind::event)
+            {
+                event["ph"] = "i";
+                event["s"] = "t";
+                event["cat"] = "event";
+            }
+            else
+            {
+                // State lasts until next state entry of the same mount point
+                auto end = now;
+                for (size_t j = i + 1; j < next; j++)
+                {
+                    const Entry& later = entries[j % capacity];
+                    if (later.kind == Kind::state &&
+                        later.source == entry.source)
+                    {
+                        end = later.time;
+                        break;
+                    }
+                }
+                event["ph"] = "X";
+                event["cat"] = "state";
+                event["dur"] = microseconds(end) - microseconds(entry.time);
+            }
+            events.push_back(std::move(event));
+        }
+
+        return nlohmann::json{{"traceEvents", std::move(events)},
+                              {"displayTimeUnit", "ms"}}
+            .dump();
+    }
+
+  private:
+    struct Entry
+    {
+        std::chrono::steady_clock::time_point time;
+        const std::string* source = nullptr;
+        const char* name = nullptr;
+        Kind kind = Kind::event;
+    };
+
+    static int64_t microseconds(std::chrono::steady_clock::time_point time)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   time.time_since_epoch())
+            .count();
+    }
+
+    TraceRing() = default;
+
+    std::array<Entry, capacity> entries;
+    uint64_t next = 0;
+};
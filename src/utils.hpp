@@ -2,6 +2,12 @@
 
 #include <boost/process/async_pipe.hpp>
 #include <boost/type_traits/has_dereference.hpp>
+#include <sdbusplus/message.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <cstring>
 #include <filesystem>
 #include <fstream>
@@ -10,8 +16,6 @@
 
 namespace fs = std::filesystem;
 
-std::string USER = "";
-
 namespace utils
 {
 constexpr const size_t secretLimit = 1024;
@@ -23,6 +27,40 @@ static void secureCleanup(T& value)
     explicit_bzero(raw, value.size() * sizeof(*raw));
 }
 
+static std::string base64Encode(const std::string& input)
+{
+    static constexpr const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string output;
+    output.reserve(((input.size() + 2) / 3) * 4);
+
+    size_t i = 0;
+    for (; i + 2 < input.size(); i += 3)
+    {
+        const uint32_t chunk = (static_cast<uint8_t>(input[i]) << 16) |
+                               (static_cast<uint8_t>(input[i + 1]) << 8) |
+                               static_cast<uint8_t>(input[i + 2]);
+        output.push_back(alphabet[(chunk >> 18) & 0x3f]);
+        output.push_back(alphabet[(chunk >> 12) & 0x3f]);
+        output.push_back(alphabet[(chunk >> 6) & 0x3f]);
+        output.push_back(alphabet[chunk & 0x3f]);
+    }
+    if (i < input.size())
+    {
+        uint32_t chunk = static_cast<uint8_t>(input[i]) << 16;
+        if (i + 1 < input.size())
+        {
+            chunk |= static_cast<uint8_t>(input[i + 1]) << 8;
+        }
+        output.push_back(alphabet[(chunk >> 18) & 0x3f]);
+        output.push_back(alphabet[(chunk >> 12) & 0x3f]);
+        output.push_back(i + 1 < input.size() ? alphabet[(chunk >> 6) & 0x3f]
+                                              : '=');
+        output.push_back('=');
+    }
+    return output;
+}
+
 class Credentials
 {
   public:
@@ -86,8 +124,7 @@ class CredentialsProvider
 
     const std::string& user()
     {
-      USER = credentials.user();
-      return credentials.user();
+        return credentials.user();
     }
 
     const std::string& password()
@@ -169,59 +206,78 @@ class NamedPipe
     Buffer buffer;
 };
 
-class VolatileFile
+// Secret handed to child process as a file without touching any filesystem.
+// Contents live in anonymous memory file locked in RAM and are wiped when
+// done. Child opens it through daemon's /proc entry, so descriptor is never
+// inherited. Size is sealed, write seal is left out so the wipe stays
+// possible.
+class SecretFile
 {
-    using Buffer = CredentialsProvider::SecureBuffer;
-
   public:
-    VolatileFile(Buffer&& contents) :
-        filePath(fs::temp_directory_path() / std::tmpnam(nullptr)),
-        size(contents->size())
+    static std::unique_ptr<SecretFile> create(const std::string& contents)
     {
-        auto data = std::move(contents);
-        create(filePath, data);
+        int fd = ::memfd_create("virtual-media-secret",
+                                MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0)
+        {
+            return {};
+        }
+        std::unique_ptr<SecretFile> secret(new SecretFile(fd, contents.size()));
+        if (!secret->fill(contents))
+        {
+            return {};
+        }
+        return secret;
     }
 
-    ~VolatileFile()
+    ~SecretFile()
     {
-        // Purge file contents
-        std::array<char, secretLimit> buf;
-        buf.fill('*');
-        std::ofstream file(filePath);
-        std::size_t bytesWritten = 0, bytesToWrite = 0;
-
-        while (bytesWritten < size)
+        if (mapping != MAP_FAILED)
         {
-            bytesToWrite = std::min(secretLimit, (size - bytesWritten));
-            file.write(buf.data(), bytesToWrite);
-            bytesWritten += bytesToWrite;
+            explicit_bzero(mapping, size);
+            ::munlock(mapping, size);
+            ::munmap(mapping, size);
         }
-
-        // Remove leftover file
-        fs::remove(filePath);
+        ::close(fd);
     }
 
-    const std::string& path()
+    SecretFile(const SecretFile&) = delete;
+    SecretFile& operator=(const SecretFile&) = delete;
+
+    std::string path() const
     {
-        return filePath;
+        return "/proc/" + std::to_string(::getpid()) + "/fd/" +
+               std::to_string(fd);
     }
 
   private:
-    static void create(const std::string& filePath, const Buffer& data)
-    {
-        // Create file
-        std::ofstream file(filePath);
-
-        // Limit permissions to owner only
-        fs::permissions(filePath,
-                        fs::perms::owner_read | fs::perms::owner_write,
-                        fs::perm_options::replace);
+    SecretFile(int fd, size_t size) : fd(fd), size(size)
+    {}
 
-        // Write contents
-        file.write(data->data(), data->size());
+    bool fill(const std::string& contents)
+    {
+        if (::ftruncate(fd, static_cast<off_t>(size)) < 0)
+        {
+            return false;
+        }
+        if (size)
+        {
+            mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                return false;
+            }
+            // Not fatal, pages are only kept out of swap
+            ::mlock(mapping, size);
+            std::memcpy(mapping, contents.data(), size);
+        }
+        return ::fcntl(fd, F_ADD_SEALS,
+                       F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0;
     }
 
-    const std::string filePath;
-    const std::size_t size;
+    int fd;
+    size_t size;
+    void* mapping = MAP_FAILED;
 };
 } // namespace utils
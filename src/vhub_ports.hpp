@@ -0,0 +1,153 @@
+#pragma once
+
+#include "logger.hpp"
+
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// Keeps track of free aspeed vhub downstream ports. Ports are scanned once at
+// startup, afterwards state is maintained in bitmap updated on acquire/release
+// and from udev "udc" change events, which kernel emits whenever gadget driver
+// is bound to or unbound from port. Bit N stands for port "<hub>:p<N+1>".
+class VhubPortAllocator
+{
+  public:
+    static constexpr const char* hubPath =
+        "/sys/bus/platform/devices/1e6a0000.usb-vhub";
+    static constexpr const unsigned maxPorts = 64;
+
+    VhubPortAllocator()
+    {
+        scan();
+    }
+
+    VhubPortAllocator(const VhubPortAllocator&) = delete;
+    VhubPortAllocator& operator=(const VhubPortAllocator&) = delete;
+
+    // Takes lowest free port
+    std::optional<std::string> acquire()
+    {
+        uint64_t bits = freePorts.load(std::memory_order_relaxed);
+        while (bits)
+        {
+            const unsigned index = std::countr_zero(bits);
+            if (freePorts.compare_exchange_weak(bits, bits & ~bit(index),
+                                                std::memory_order_acq_rel))
+            {
+                return portName(index);
+            }
+        }
+        return {};
+    }
+
+    void release(const std::string& port)
+    {
+        if (auto index = portIndex(port))
+        {
+            freePorts.fetch_or(bit(*index) & existingPorts,
+                               std::memory_order_acq_rel);
+        }
+    }
+
+    // Called for udev change event of "udc" subsystem, function is content of
+    // its "function" attribute (name of bound gadget driver, empty if none)
+    void update(const std::string& port, const std::string& function)
+    {
+        const auto index = portIndex(port);
+        if (!index || !(existingPorts & bit(*index)))
+        {
+            return;
+        }
+        if (function.empty())
+        {
+            freePorts.fetch_or(bit(*index), std::memory_order_acq_rel);
+        }
+        else
+        {
+            freePorts.fetch_and(~bit(*index), std::memory_order_acq_rel);
+        }
+        LogMsg(Logger::Debug, "[VhubPortAllocator]: ", port,
+               function.empty() ? " released" : " bound to ", function);
+    }
+
+  private:
+    static uint64_t bit(unsigned index)
+    {
+        return uint64_t(1) << index;
+    }
+
+    static std::string hubName()
+    {
+        return fs::path(hubPath).filename();
+    }
+
+    static std::string portName(unsigned index)
+    {
+        return hubName() + ":p" + std::to_string(index + 1);
+    }
+
+    static std::optional<unsigned> portIndex(const std::string& port)
+    {
+        const std::string prefix = hubName() + ":p";
+        if (port.compare(0, prefix.size(), prefix) != 0)
+        {
+            return {};
+        }
+        unsigned number = 0;
+        const char* begin = port.data() + prefix.size();
+        const char* end = port.data() + port.size();
+        auto [ptr, ec] = std::from_chars(begin, end, number);
+        if (ec != std::errc() || ptr != end || number == 0 ||
+            number > maxPorts)
+        {
+            return {};
+        }
+        return number - 1;
+    }
+
+    void scan()
+    {
+        uint64_t found = 0;
+        uint64_t free = 0;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(hubPath, ec))
+        {
+            const auto index = portIndex(entry.path().filename());
+            if (!index || fs::is_symlink(entry, ec) ||
+                !fs::is_directory(entry, ec))
+            {
+                continue;
+            }
+            found |= bit(*index);
+
+            std::string function;
+            std::ifstream file(fs::path("/sys/class/udc") /
+                               entry.path().filename() / "function");
+            std::getline(file, function);
+            if (function.empty())
+            {
+                free |= bit(*index);
+            }
+        }
+        if (ec)
+        {
+            LogMsg(Logger::Error, "[VhubPortAllocator]: Unable to scan ",
+                   hubPath, ": ", ec.message());
+        }
+        existingPorts = found;
+        freePorts.store(free, std::memory_order_release);
+        LogMsg(Logger::Debug, "[VhubPortAllocator]: ", std::popcount(found),
+               " ports, ", std::popcount(free), " free");
+    }
+
+    uint64_t existingPorts = 0;
+    std::atomic<uint64_t> freePorts{0};
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "logger.hpp"
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+// Small pool of threads for system calls which may block for long time (CIFS
+// mount, umount, file I/O). Everything else, including all state machines,
+// keeps running on the single event loop thread.
+class WorkerPool
+{
+  public:
+    using Executor = boost::asio::thread_pool::executor_type;
+    using Strand = boost::asio::strand<Executor>;
+
+    // Threads spend their time blocked in system calls, not computing, so
+    // count doesn't follow cores. Single stuck CIFS mount must not hold up
+    // file I/O of all other slots even on single-core BMC.
+    static constexpr const unsigned threads = 4;
+
+    WorkerPool() : pool(threads)
+    {}
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool()
+    {
+        join();
+    }
+
+    // Work already queued (eg. unmounts) is still finished, owner calls this
+    // before destroying anything that work refers to
+    void join()
+    {
+        pool.join();
+    }
+
+    Executor executor()
+    {
+        return pool.get_executor();
+    }
+
+    // Operations posted to the same strand run one after another, in order
+    Strand makeStrand()
+    {
+        return boost::asio::make_strand(pool.get_executor());
+    }
+
+  private:
+    boost::asio::thread_pool pool;
+};
+
+// Runs function on given executor and suspends calling coroutine until it
+// returns. Result is delivered back on coroutine's own executor, so caller
+// never observes being resumed on a worker thread.
+template <typename Executor, typename Function>
+auto runBlocking(const Executor& executor, Function&& function,
+                 boost::asio::yield_context yield)
+{
+    using Result = std::invoke_result_t<Function>;
+    return boost::asio::async_initiate<boost::asio::yield_context,
+                                       void(Result)>(
+        [executor](auto handler, auto function) {
+            auto work = boost::asio::make_work_guard(
+                boost::asio::get_associated_executor(handler));
+            boost::asio::post(
+                executor, [handler = std::move(handler),
+                           function = std::move(function),
+                           work = std::move(work)]() mutable {
+                    Result result = function();
+                    auto resumeExecutor = work.get_executor();
+                    boost::asio::post(
+                        resumeExecutor,
+                        [handler = std::move(handler),
+                         result = std::move(result)]() mutable {
+                            handler(std::move(result));
+                        });
+                });
+        },
+        yield, std::forward<Function>(function));
+}